@@ -14,7 +14,7 @@
   "targets": [
     {
       "target_name": "imagemagick",
-      "sources": [ "src/imagemagick.cc", "src/async_magick.cc" ],
+      "sources": [ "src/imagemagick.cc", "src/async_magick.cc", "src/fingerprint.cc", "src/admission.cc", "src/native_memory.cc", "src/image_ops.cc", "src/image_handle.cc", "src/overlay.cc", "src/tile_pyramid.cc", "src/helper_pool.cc", "src/coalesce.cc", "src/formats.cc" ],
       'cflags!': [ '-fno-exceptions' ],
       'cflags_cc!': [ '-fno-exceptions' ],
       "conditions": [
@@ -51,6 +51,8 @@
         }], ['OS=="linux"', { # not windows not mac
           "libraries": [
             '<!@(Magick++-config --ldflags --libs)',
+            '-lrt',
+            '-ldl',
           ],
           'include_dirs': [
             "<!(node -e \"require('nan')\")",
@@ -60,5 +62,39 @@
           ],
         }]
       ]
+    }, {
+      # helper process for setWorkerPool(), not needed on windows where the pool isn't supported
+      "target_name": "imagemagick_helper",
+      "type": "executable",
+      "sources": [ "src/helper.cc", "src/image_ops.cc", "src/fingerprint.cc", "src/formats.cc" ],
+      'cflags!': [ '-fno-exceptions' ],
+      'cflags_cc!': [ '-fno-exceptions' ],
+      "conditions": [
+        ['OS=="win"', {
+          'type': 'none',
+          'sources/': [ ['exclude', '.*'] ],
+        }], ['OS=="mac"', {
+          'xcode_settings': {
+            'GCC_ENABLE_CPP_EXCEPTIONS': 'YES',
+            'OTHER_CFLAGS': [
+              '<!@(Magick++-config --cflags)'
+            ]
+          },
+          "libraries": [
+             '<!@(Magick++-config --ldflags --libs)',
+          ],
+          'cflags': [
+            '<!@(Magick++-config --cflags --cppflags)'
+          ],
+        }], ['OS=="linux"', {
+          "libraries": [
+            '<!@(Magick++-config --ldflags --libs)',
+            '-lrt',
+          ],
+          'cflags': [
+            '<!@(Magick++-config --cflags --cppflags)'
+          ],
+        }]
+      ]
     }]
   }
@@ -0,0 +1,266 @@
+#ifndef BUILDING_NODE_EXTENSION
+#define BUILDING_NODE_EXTENSION
+#endif  // BUILDING_NODE_EXTENSION
+
+#include "admission.h"
+#include "formats.h"
+#include "helper_pool.h"
+#include "native_memory.h"
+#include <deque>
+#include <map>
+#include <set>
+#include <stdio.h>
+#include <uv.h>
+
+static size_t maxPixels       = 0;
+static size_t maxMemory       = 0;
+static size_t inFlightBytes   = 0;
+static std::deque<MagickWorker*> pending;
+
+// out of process jobs wait here rather than on a threadpool thread blocked on a busy helper
+static unsigned int helperJobs = 0;
+static std::deque<MagickWorker*> helperPending;
+
+// pings finish in any order, jobs are admitted or rejected in the order they were queued
+struct AdmissionDecision {
+  MagickWorker *job;
+  std::string error; // empty admits the job
+  const char *code;
+};
+static unsigned long nextTicket  = 0;
+static unsigned long admitTicket = 0;
+static std::map<unsigned long, AdmissionDecision> decided;
+
+// jobs rejected on the main thread, failed from a timer on the next loop iteration.
+// an inactive timer doesn't keep the loop alive, a started one does until it fires
+static std::deque<AdmissionDecision> rejected;
+static uv_timer_t rejectTimer;
+static bool rejectTimerInitialized = false;
+
+// pings a job's header, and routes jobs read from a file, on the threadpool, so slow or
+// hostile headers don't block the event loop, then admits or rejects the job on the main thread
+class AdmissionPing:public NanAsyncWorker {
+  public:
+    AdmissionPing(MagickWorker *job, const char *srcPath, size_t jobMaxPixels, int debug);
+    void Execute();
+    void WorkComplete();
+  private:
+    MagickWorker *job;
+    unsigned long ticket;
+    Magick::Blob srcBlob;
+    std::string srcPath;
+    std::string hint;
+    std::set<std::string> allowed;
+    size_t jobMaxPixels;
+    int debug;
+    std::string srcFormat;
+    size_t columns;
+    size_t rows;
+    std::string message;
+    const char *code;
+};
+
+static bool Fits(size_t cost) {
+  return !maxMemory || !inFlightBytes || inFlightBytes + cost <= maxMemory;
+}
+
+static void Dispatch(MagickWorker *worker) {
+  inFlightBytes += worker->cost;
+  AdjustNativeMemory(NATIVE_MEMORY_PIXELS, worker->cost);
+  NanAsyncQueueWorker(worker);
+}
+
+void SetAdmissionLimits(size_t pixels, size_t memory) {
+  maxPixels = pixels;
+  maxMemory = memory;
+  // a raised budget may admit waiting jobs
+  ReleaseAdmission(0);
+}
+
+void GetAdmissionLimits(size_t *pixels, size_t *memory) {
+  *pixels = maxPixels;
+  *memory = maxMemory;
+}
+
+size_t EffectiveMaxPixels(size_t jobMaxPixels) {
+  if (jobMaxPixels && (!maxPixels || jobMaxPixels < maxPixels))
+    return jobMaxPixels;
+  return maxPixels;
+}
+
+static void OnRejectTimer(uv_timer_t *handle, int status) {
+  NanScope();
+  std::deque<AdmissionDecision> jobs;
+  jobs.swap(rejected);
+  for (size_t i = 0; i < jobs.size(); i++) {
+    jobs[i].job->Reject(jobs[i].error, jobs[i].code);
+    delete jobs[i].job;
+  }
+}
+
+// fails job from the event loop, without waiting for a threadpool thread
+static void RejectLater(MagickWorker *job, const std::string &error, const char *code) {
+  if (!rejectTimerInitialized) {
+    uv_timer_init(uv_default_loop(), &rejectTimer);
+    rejectTimerInitialized = true;
+  }
+  AdmissionDecision decision;
+  decision.job   = job;
+  decision.error = error;
+  decision.code  = code;
+  rejected.push_back(decision);
+  if (rejected.size() == 1)
+    uv_timer_start(&rejectTimer, OnRejectTimer, 0, 0);
+}
+
+// routes a blob job on the main thread, sniffing is a bounded memcmp.
+// returns false after rejecting the job
+static bool RouteBlob(MagickWorker *worker, int debug) {
+  std::string srcFormat, error;
+  const Magick::Blob &blob = worker->SourceBlob();
+  if (!RouteInputFormat(AllowedFormats(), blob.data(), blob.length(), worker->srcFormat.c_str(), &srcFormat, &error)) {
+    RejectLater(worker, error, "EFORMAT");
+    return false;
+  }
+  if (debug) printf("admission: format %s\n", srcFormat.empty() ? "detected" : srcFormat.c_str());
+  worker->srcFormat = srcFormat;
+  return true;
+}
+
+AdmissionPing::AdmissionPing(MagickWorker *job, const char *srcPath, size_t jobMaxPixels, int debug):NanAsyncWorker(NULL) {
+  this->job          = job;
+  this->ticket       = nextTicket++;
+  this->srcBlob      = job->SourceBlob();
+  this->srcPath      = srcPath ? srcPath : "";
+  this->srcFormat    = job->srcFormat;
+  this->jobMaxPixels = jobMaxPixels;
+  this->debug        = debug;
+  this->columns      = 0;
+  this->rows         = 0;
+  this->code         = NULL;
+  // blobs are routed already, files are sniffed here
+  if (srcPath) {
+    this->hint    = job->srcFormat;
+    this->allowed = AllowedFormats();
+  }
+};
+void AdmissionPing::Execute() {
+  if (!srcPath.empty()) {
+    if (!RouteInputFile(allowed, srcPath.c_str(), hint.c_str(), &srcFormat, &message)) {
+      code = "EFORMAT";
+      this->errmsg = message.c_str();
+      return;
+    }
+    if (debug) printf("admission: format %s\n", srcFormat.empty() ? "detected" : srcFormat.c_str());
+  }
+
+  Magick::Image image;
+  try {
+    // reads the header only, no pixels are allocated
+    if (!srcPath.empty()) {
+      image.ping(srcFormat.empty() ? srcPath : srcFormat + ":" + srcPath);
+    } else {
+      if (!srcFormat.empty())
+        image.magick(srcFormat);
+      image.ping(srcBlob);
+    }
+  } catch (std::exception& err) {
+    message  = "image.ping failed with error: ";
+    message += err.what();
+    this->errmsg = message.c_str();
+    return;
+  } catch (...) {
+    this->errmsg = "unhandled error";
+    return;
+  }
+  columns = image.columns();
+  rows    = image.rows();
+};
+void AdmissionPing::WorkComplete() {
+  NanScope();
+  if (!this->errmsg) {
+    size_t limit = EffectiveMaxPixels(jobMaxPixels);
+    if (debug) printf("admission: %d x %d pixels, limit %lu\n", (int) columns, (int) rows, (unsigned long) limit);
+
+    if (limit && columns * rows > limit) {
+      char exceeds[128];
+      snprintf(exceeds, sizeof(exceeds), "image exceeds maxPixels: %dx%d", (int) columns, (int) rows);
+      message = exceeds;
+      code    = "EMAXPIXELS";
+      this->errmsg = message.c_str();
+    }
+  }
+
+  AdmissionDecision decision;
+  decision.job  = job;
+  decision.code = code;
+  if (this->errmsg) {
+    decision.error = this->errmsg;
+  } else {
+    job->srcFormat = srcFormat;
+    job->cost      = job->DecodedCost(columns, rows);
+  }
+  decided[ ticket ] = decision;
+
+  // callbacks of rejected jobs may queue new ones, so look the next ticket up every time
+  std::map<unsigned long, AdmissionDecision>::iterator it;
+  while ((it = decided.find(admitTicket)) != decided.end()) {
+    AdmissionDecision next = it->second;
+    decided.erase(it);
+    admitTicket++;
+    if (next.error.empty()) {
+      AdmitWorker(next.job);
+    } else {
+      next.job->Reject(next.error, next.code);
+      delete next.job;
+    }
+  }
+};
+
+void PingAndAdmitWorker(MagickWorker *worker, const char *srcPath, size_t jobMaxPixels, int debug) {
+  if (!srcPath && !RouteBlob(worker, debug))
+    return;
+  NanAsyncQueueWorker(new AdmissionPing(worker, srcPath, jobMaxPixels, debug));
+}
+
+void RouteAndAdmitWorker(MagickWorker *worker, size_t jobMaxPixels, int debug) {
+  if (!RouteBlob(worker, debug))
+    return;
+  // decoded elsewhere, nothing to reserve in this process
+  worker->cost      = 0;
+  worker->maxPixels = EffectiveMaxPixels(jobMaxPixels);
+  worker->inHelper  = true;
+  if (helperJobs < HelperPoolSize()) {
+    helperJobs++;
+    Dispatch(worker);
+  } else {
+    helperPending.push_back(worker);
+  }
+}
+
+void ReleaseHelperSlot() {
+  helperJobs--;
+  if (!helperPending.empty()) {
+    MagickWorker *worker = helperPending.front();
+    helperPending.pop_front();
+    helperJobs++;
+    Dispatch(worker);
+  }
+}
+
+void AdmitWorker(MagickWorker *worker) {
+  if (pending.empty() && Fits(worker->cost))
+    Dispatch(worker);
+  else
+    pending.push_back(worker);
+}
+
+void ReleaseAdmission(size_t cost) {
+  inFlightBytes -= cost;
+  AdjustNativeMemory(NATIVE_MEMORY_PIXELS, -(ssize_t)cost);
+  while (!pending.empty() && Fits(pending.front()->cost)) {
+    MagickWorker *worker = pending.front();
+    pending.pop_front();
+    Dispatch(worker);
+  }
+}
@@ -0,0 +1,44 @@
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+#include "async_magick.h"
+
+// Jobs are admitted against a global budget before they reach the libuv threadpool:
+//   maxPixels: jobs whose header claims more pixels fail with err.code "EMAXPIXELS"
+//   maxMemory: jobs wait in FIFO order while the estimated decoded bytes of running jobs
+//              would exceed this. a job larger than maxMemory runs alone.
+// Pinged jobs are admitted or rejected in the order they were queued, whichever ping finishes first.
+// 0 means unlimited. All functions must be called from the main thread.
+
+void SetAdmissionLimits(size_t maxPixels, size_t maxMemory);
+
+void GetAdmissionLimits(size_t *maxPixels, size_t *maxMemory);
+
+// the global maxPixels, lowered by jobMaxPixels (0: none)
+size_t EffectiveMaxPixels(size_t jobMaxPixels);
+
+// routes the worker's input format (see formats.h) and pings its header on the threadpool,
+// then sets worker->cost to the estimated decoded byte size and admits it.
+// srcPath NULL pings the worker's srcBlob. worker->srcFormat is the caller's inputFormat hint
+// or empty, and is set to the decoder to read with.
+// disallowed formats, ping failures and images exceeding maxPixels (lowered by jobMaxPixels, 0: none)
+// fail the worker's callback asynchronously with err.code "EFORMAT", none and "EMAXPIXELS".
+// the worker is deleted then, without running. blobs are sniffed on the calling thread, and their
+// "EFORMAT" rejections come from the next loop iteration instead of waiting for the threadpool
+void PingAndAdmitWorker(MagickWorker *worker, const char *srcPath, size_t jobMaxPixels, int debug);
+
+// for workers parsing the header in another process: routes the worker's input format from its
+// magic bytes only, sets worker->maxPixels to the effective limit and admits it at cost 0.
+// disallowed formats fail the worker's callback on the next loop iteration with err.code "EFORMAT".
+// at most one job per helper is dispatched to the threadpool, others wait in FIFO order
+void RouteAndAdmitWorker(MagickWorker *worker, size_t jobMaxPixels, int debug);
+
+// called when a job admitted by RouteAndAdmitWorker completes, dispatches the next waiting one
+void ReleaseHelperSlot();
+
+// queues worker, whose cost is set, now if it fits in the budget, otherwise after running jobs release theirs
+void AdmitWorker(MagickWorker *worker);
+
+void ReleaseAdmission(size_t cost);
+
+#endif // ADMISSION_H
@@ -3,15 +3,75 @@
 #endif  // BUILDING_NODE_EXTENSION
 
 #include "async_magick.h"
+#include "admission.h"
+#include "coalesce.h"
+#include "fingerprint.h"
+#include "formats.h"
+#include "helper_pool.h"
+#include "image_handle.h"
+#include "image_ops.h"
+#include "native_memory.h"
+#include "overlay.h"
+#include <algorithm>
+#include <map>
+#include <string.h>
+
+MagickWorker::MagickWorker(NanCallback *callback, Magick::Blob srcBlob):NanAsyncWorker(callback) {
+  this->cost      = 0;
+  this->maxPixels = 0;
+  this->inHelper  = false;
+  this->srcBlob   = srcBlob;
+  this->errcode = NULL;
+  AdjustNativeMemory(NATIVE_MEMORY_INPUT, srcBlob.length());
+};
+MagickWorker::~MagickWorker() {
+  AdjustNativeMemory(NATIVE_MEMORY_INPUT, -(ssize_t)srcBlob.length());
+};
+void MagickWorker::WorkComplete() {
+  NanAsyncWorker::WorkComplete();
+  if (inHelper)
+    ReleaseHelperSlot();
+  ReleaseAdmission(cost);
+};
+void MagickWorker::HandleErrorCallback() {
+  NanScope();
+  Local<Value> argv[] = {ErrorValue()};
+  callback->Call(1, argv);
+};
+void MagickWorker::Reject(const std::string &error, const char *code) {
+  rejection     = error;
+  this->errmsg  = rejection.c_str();
+  this->errcode = code;
+  // nothing was reserved, completing calls the error callback
+  cost = 0;
+  WorkComplete();
+};
+size_t MagickWorker::DecodedCost(size_t columns, size_t rows) const {
+  return columns * rows * sizeof(Magick::PixelPacket);
+};
+const Magick::Blob &MagickWorker::SourceBlob() const {
+  return srcBlob;
+};
+Local<Value> MagickWorker::ErrorValue() {
+  Local<Object> err = Exception::Error(String::New(errmsg))->ToObject();
+  if (errcode)
+    err->Set(NanSymbol("code"), String::New(errcode));
+  return err;
+};
+///////////////////////////////////////////////////////////////////////////////////////////////
 
-ConvertWorker::ConvertWorker(NanCallback *callback, int debug, Magick::Blob srcBlob, unsigned int width, unsigned int height, unsigned int quality, const char *format, const char *resizeStyle):NanAsyncWorker(callback) {
+ConvertWorker::ConvertWorker(NanCallback *callback, int debug, Magick::Blob srcBlob, unsigned int width, unsigned int height, unsigned int quality, const char *format, const char *resizeStyle, int analyze, unsigned int componentsX, unsigned int componentsY, const char *composite, int outOfProcess):MagickWorker(callback, srcBlob) {
   this->debug       = debug;
-  this->srcBlob     = srcBlob;
   this->width       = width;
   this->height      = height;
   this->quality     = quality;
   this->format      = format;
   this->resizeStyle = resizeStyle;
+  this->analyze     = analyze;
+  this->componentsX = componentsX;
+  this->componentsY = componentsY;
+  this->composite   = composite;
+  this->outOfProcess = outOfProcess;
   if (debug) printf("resizeStyle: %s\n", resizeStyle);
 };
 ConvertWorker::~ConvertWorker() {
@@ -19,19 +79,71 @@ ConvertWorker::~ConvertWorker() {
     delete[] format;
   if (resizeStyle)
     delete[] resizeStyle;
+  if (composite)
+    delete[] composite;
+  for (size_t i = 0; i < waiters.size(); i++)
+    delete waiters[i];
+};
+void ConvertWorker::Coalesce(const std::string &key) {
+  coalesceKey = key;
+  AddInFlight(key, this);
+};
+void ConvertWorker::AddWaiter(NanCallback *waiter) {
+  waiters.push_back(waiter);
+};
+bool ConvertWorker::SameSource(const char *data, size_t length) const {
+  return srcBlob.length() == length && memcmp(srcBlob.data(), data, length) == 0;
+};
+void ConvertWorker::WorkComplete() {
+  // jobs arriving from now on start a new worker
+  if (!coalesceKey.empty())
+    RemoveInFlight(coalesceKey, this);
+  MagickWorker::WorkComplete();
+};
+void ConvertWorker::ExecuteInHelper() {
+  HelperRequest request;
+  memset(&request, 0, sizeof(request));
+  request.width       = width;
+  request.height      = height;
+  request.quality     = quality;
+  request.analyze     = analyze;
+  request.componentsX = componentsX;
+  request.componentsY = componentsY;
+  request.debug       = debug;
+  if (format)
+    snprintf(request.format, sizeof(request.format), "%s", format);
+  snprintf(request.resizeStyle, sizeof(request.resizeStyle), "%s", resizeStyle);
+  snprintf(request.inputFormat, sizeof(request.inputFormat), "%s", srcFormat.c_str());
+  request.maxPixels   = maxPixels;
+
+  HelperResponse response;
+  memset(&response, 0, sizeof(response));
+  if (!RunInHelper(request, srcBlob, &dstBlob, &response, &message)) {
+    this->errmsg = message.c_str();
+    if (response.code[0]) {
+      helperCode    = std::string(response.code, strnlen(response.code, sizeof(response.code)));
+      this->errcode = helperCode.c_str();
+    }
+    return;
+  }
+  if (analyze) {
+    phash    = response.phash;
+    blurhash = response.blurhash;
+  }
 };
 void ConvertWorker::Execute() {
+  if (outOfProcess) {
+    ExecuteInHelper();
+    return;
+  }
+
   // Magick::InitializeMagick(NULL);
   Magick::Image image;
-  image.read("/Users/rakusai/Work/Gyazo/node-imagemagick-native/test/test.jpg");
-  image.write("/Users/rakusai/Work/Gyazo/node-imagemagick-native/test/test10.jpg");
-
-  return;
   try {
-    image.read(srcBlob);
+    ReadImage(image, srcBlob, srcFormat);
   } catch (std::exception& err) {
-    std::string message = "image.read failed with error: ";
-    message            += err.what();
+    message  = "image.read failed with error: ";
+    message += err.what();
     this->errmsg = message.c_str();
     return;
   } catch (...) {
@@ -39,6 +151,23 @@ void ConvertWorker::Execute() {
     return;
   }
 
+  if (analyze) {
+    // fingerprint the source while it's decoded anyway
+    try {
+      AnalyzeImage(image, componentsX, componentsY, &phash, &blurhash);
+    } catch (std::exception& err) {
+      message  = "analyze failed with error: ";
+      message += err.what();
+      this->errmsg = message.c_str();
+      return;
+    } catch (...) {
+      this->errmsg = "analyze failed";
+      return;
+    }
+    if (debug)
+      printf("phash: %s, blurhash: %s\n", phash.c_str(), blurhash.c_str());
+  }
+
   if (format)
     image.magick(format);
   if (debug)
@@ -48,78 +177,23 @@ void ConvertWorker::Execute() {
     printf("original width,height: %d, %d\n", (int) image.columns(), (int) image.rows());
 
   if (width || height) {
-    if (!width)
-      width  = image.columns();
-    if (!height)
-      height = image.rows();
-
-    // do resize
-    if ( strcmp( resizeStyle, "aspectfill" ) == 0 ) {
-      // ^ : Fill Area Flag ('^' flag)
-      // is not implemented in Magick++
-      // and gravity: center, extent doesnt look like working as exptected
-      // so we do it ourselves
-
-      // keep aspect ratio, get the exact provided size, crop top/bottom or left/right if necessary
-      double aspectratioExpected = (double)height / (double)width;
-      double aspectratioOriginal = (double)image.rows() / (double)image.columns();
-      unsigned int xoffset = 0;
-      unsigned int yoffset = 0;
-      unsigned int resizewidth;
-      unsigned int resizeheight;
-
-      if ( aspectratioExpected > aspectratioOriginal ) {
-        // expected is taller
-        resizewidth  = (unsigned int)( (double)height / (double)image.rows() * (double)image.columns() + 1. );
-        resizeheight = height;
-        xoffset      = (unsigned int)( (resizewidth - width) / 2. );
-        yoffset      = 0;
-      } else {
-        // expected is wider
-        resizewidth  = width;
-        resizeheight = (unsigned int)( (double)width / (double)image.columns() * (double)image.rows() + 1. );
-        xoffset      = 0;
-        yoffset      = (unsigned int)( (resizeheight - height) / 2. );
-      }
-
-      if (debug)
-        printf("resize to: %d, %d\n", resizewidth, resizeheight);
-      Magick::Geometry resizeGeometry(resizewidth, resizeheight, 0, 0, 0, 0);
-      image.resize(resizeGeometry);
-
-      // limit canvas size to cropGeometry
-      if (debug)
-        printf( "crop to: %d, %d, %d, %d\n", width, height, xoffset, yoffset );
-      Magick::Geometry cropGeometry( width, height, xoffset, yoffset, 0, 0 );
-
-      Magick::Color transparent("white");
-      if (format) {
-        // make background transparent for PNG
-        // JPEG background becomes black if set transparent here
-        transparent.alpha(1.);
-      }
-      image.extent( cropGeometry, transparent );
-    } else if (strcmp (resizeStyle, "aspectfit") == 0 ) {
-      // keep aspect ratio, get the maximum image which fits inside specified size
-      char geometryString[32];
-      sprintf( geometryString, "%dx%d", width, height );
-      if (debug)
-        printf( "resize to: %s\n", geometryString );
-      image.resize(geometryString);
-    } else if (strcmp (resizeStyle, "fill") == 0) {
-      // change aspect ratio and fill specified size
-      char geometryString[32];
-      sprintf( geometryString, "%dx%d!", width, height );
-      if (debug)
-        printf( "resize to: %s\n", geometryString );
-      image.resize(geometryString);
-    } else {
-      this->errmsg = "resizeStyle not supported";
+    this->errmsg = ResizeImage(image, width, height, resizeStyle, format, debug);
+    if (this->errmsg)
       return;
-    }
+  }
 
-    if (debug)
-      printf( "resized to: %d, %d\n", (int)image.columns(), (int)image.rows() );
+  if (composite) {
+    try {
+      this->errmsg = CompositeOverlay(image, composite, debug);
+    } catch (std::exception& err) {
+      message  = "composite failed with error: ";
+      message += err.what();
+      this->errmsg = message.c_str();
+    } catch (...) {
+      this->errmsg = "composite failed";
+    }
+    if (this->errmsg)
+      return;
   }
 
   if (quality) {
@@ -132,9 +206,29 @@ void ConvertWorker::Execute() {
 };
 void ConvertWorker::HandleOKCallback() {
   NanScope();
-  Local<v8::Value> retBuffer = NanNewBufferHandle((char*)dstBlob.data(), dstBlob.length());
+  Local<v8::Value> retBuffer = NativeMemoryBuffer(dstBlob);
+  if (analyze) {
+    Local<Object> analysis = Object::New();
+    analysis->Set(NanSymbol("phash"), String::New(phash.c_str()));
+    analysis->Set(NanSymbol("blurhash"), String::New(blurhash.c_str()));
+    Local<Value> argv[] = {Local<Value>::New(Undefined()), retBuffer, analysis};
+    callback->Call(3, argv);
+    for (size_t i = 0; i < waiters.size(); i++)
+      waiters[i]->Call(3, argv);
+    return;
+  }
   Local<Value> argv[] = {Local<Value>::New(Undefined()), retBuffer};
   callback->Call(2, argv);
+  for (size_t i = 0; i < waiters.size(); i++)
+    waiters[i]->Call(2, argv);
+};
+void ConvertWorker::HandleErrorCallback() {
+  NanScope();
+  MagickWorker::HandleErrorCallback();
+  for (size_t i = 0; i < waiters.size(); i++) {
+    Local<Value> argv[] = {ErrorValue()};
+    waiters[i]->Call(1, argv);
+  }
 };
 ///////////////////////////////////////////////////////////////////////////////////////////////
 
@@ -296,9 +390,8 @@ void ConvertFileWorker::HandleOKCallback() {
 };
 
 ///////////////////////////////////////////////////////////////////////////////////////////////
-CropWorker::CropWorker(NanCallback *callback, int debug, Magick::Blob srcBlob, double pWidth, double pHeight, double pTop, double pLeft, unsigned int quality, const char *format):NanAsyncWorker(callback) {
+CropWorker::CropWorker(NanCallback *callback, int debug, Magick::Blob srcBlob, double pWidth, double pHeight, double pTop, double pLeft, unsigned int quality, const char *format):MagickWorker(callback, srcBlob) {
   this->debug   = debug;
-  this->srcBlob = srcBlob;
   this->pWidth  = pWidth;
   this->pHeight = pHeight;
   this->pTop    = pTop;
@@ -314,10 +407,10 @@ void CropWorker::Execute() {
   // Magick::InitializeMagick(NULL);
   Magick::Image image;
   try {
-    image.read(srcBlob);
+    ReadImage(image, srcBlob, srcFormat);
   } catch (std::exception& err) {
-    std::string message = "image.read failed with error: ";
-    message            += err.what();
+    message  = "image.read failed with error: ";
+    message += err.what();
     this->errmsg = message.c_str();
     return;
   } catch (...) {
@@ -330,25 +423,7 @@ void CropWorker::Execute() {
   if (debug)
     printf( "format: %s\n", format );
 
-  unsigned int width = pWidth*image.columns();
-  if (debug) printf( "width: %d\n", width );
-
-  unsigned int height = pHeight*image.rows();
-  if (debug) printf( "height: %d\n", height );
-
-  unsigned int top = pTop*image.rows();
-  if (debug) printf( "top: %d\n", top );
-
-  unsigned int left = pLeft*image.columns();
-  if (debug) printf( "left: %d\n", left );
-
-  // limit canvas size to cropGeometry
-  if (debug) printf("crop to: %d, %d, %d, %d\n", width, height, left, top);
-  Magick::Geometry cropGeometry( width, height, left, top, 0, 0 );
-
-  image.crop(cropGeometry);
-
-  if (debug) printf( "cropped to: %d, %d\n", (int)image.columns(), (int)image.rows() );
+  CropImage(image, pWidth, pHeight, pTop, pLeft, debug);
 
   if (quality) {
     if (debug)
@@ -360,24 +435,23 @@ void CropWorker::Execute() {
 };
 void CropWorker::HandleOKCallback() {
   NanScope();
-  Local<v8::Value> retBuffer = NanNewBufferHandle((char*)dstBlob.data(), dstBlob.length());
+  Local<v8::Value> retBuffer = NativeMemoryBuffer(dstBlob);
   Local<Value> argv[] = {Local<Value>::New(Undefined()), retBuffer};
   callback->Call(2, argv);
 };
 ///////////////////////////////////////////////////////////////////////////////////////////////////
-NormalizeWorker::NormalizeWorker(NanCallback *callback, int debug, Magick::Blob srcBlob):NanAsyncWorker(callback) {
+NormalizeWorker::NormalizeWorker(NanCallback *callback, int debug, Magick::Blob srcBlob):MagickWorker(callback, srcBlob) {
   this->debug   = debug;
-  this->srcBlob = srcBlob;
 }
 NormalizeWorker::~NormalizeWorker() {};
 void NormalizeWorker::Execute() {
   // Magick::InitializeMagick(NULL);
   Magick::Image image;
   try {
-    image.read(srcBlob);
+    ReadImage(image, srcBlob, srcFormat);
   } catch (std::exception& err) {
-    std::string message = "image.read failed with error: ";
-    message            += err.what();
+    message  = "image.read failed with error: ";
+    message += err.what();
     this->errmsg = message.c_str();
     return;
   } catch (...) {
@@ -385,45 +459,270 @@ void NormalizeWorker::Execute() {
     return;
   }
 
-  int orientation = atoi(image.attribute("EXIF:Orientation").c_str());
-  if (debug) printf("orientation: %d\n", orientation);
-
-  switch (orientation) {
-    case 1:
-      // no need to do anything
-      break;
-    case 2:
-      image.flip();
-      break;
-    case 3:
-      image.rotate(180);
-      break;
-    case 4:
-      image.flop();
-      break;
-    case 5:
-      image.rotate(90);
-      image.flip();
-      break;
-    case 6:
-      image.rotate(90);
-      break;
-    case 7:
-      image.rotate(-90);
-      image.flip();
-      break;
-    case 8:
-      image.rotate(-90);
-      break;
-    default:
-      if (debug) printf("orientation is missing. skipping");
-  }
+  OrientImage(image, debug);
   image.strip();
   image.write(&dstBlob);
 };
 void NormalizeWorker::HandleOKCallback() {
   NanScope();
-  Local<v8::Value> retBuffer = NanNewBufferHandle((char*)dstBlob.data(), dstBlob.length());
+  Local<v8::Value> retBuffer = NativeMemoryBuffer(dstBlob);
   Local<Value> argv[] = {Local<Value>::New(Undefined()), retBuffer};
   callback->Call(2, argv);
 };
+///////////////////////////////////////////////////////////////////////////////////////////////////
+IdentifyWorker::IdentifyWorker(NanCallback *callback, int debug, Magick::Blob srcBlob, int analyze, unsigned int componentsX, unsigned int componentsY):MagickWorker(callback, srcBlob) {
+  this->debug       = debug;
+  this->analyze     = analyze;
+  this->componentsX = componentsX;
+  this->componentsY = componentsY;
+  this->width       = 0;
+  this->height      = 0;
+  this->depth       = 0;
+}
+IdentifyWorker::~IdentifyWorker() {};
+void IdentifyWorker::Execute() {
+  Magick::Image image;
+  try {
+    ReadImage(image, srcBlob, srcFormat);
+  } catch (std::exception& err) {
+    message  = "image.read failed with error: ";
+    message += err.what();
+    this->errmsg = message.c_str();
+    return;
+  } catch (...) {
+    this->errmsg = "unhandled error";
+    return;
+  }
+
+  if (debug) printf("original width,height: %d, %d\n", (int) image.columns(), (int) image.rows());
+
+  width  = image.columns();
+  height = image.rows();
+  depth  = image.depth();
+  format = image.magick();
+
+  if (analyze) {
+    try {
+      AnalyzeImage(image, componentsX, componentsY, &phash, &blurhash);
+    } catch (std::exception& err) {
+      message  = "analyze failed with error: ";
+      message += err.what();
+      this->errmsg = message.c_str();
+    } catch (...) {
+      this->errmsg = "analyze failed";
+    }
+  }
+};
+void IdentifyWorker::HandleOKCallback() {
+  NanScope();
+  Local<Object> out = Object::New();
+  out->Set(NanSymbol("width"), Integer::New(width));
+  out->Set(NanSymbol("height"), Integer::New(height));
+  out->Set(NanSymbol("depth"), Integer::New(depth));
+  out->Set(NanSymbol("format"), String::New(format.c_str()));
+  if (analyze) {
+    out->Set(NanSymbol("phash"), String::New(phash.c_str()));
+    out->Set(NanSymbol("blurhash"), String::New(blurhash.c_str()));
+  }
+  Local<Value> argv[] = {Local<Value>::New(Undefined()), out};
+  callback->Call(2, argv);
+};
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// longest side of the proxy image we quantize on.
+// decoders supporting a size hint (JPEG) decode straight to about this size
+#define QUANTIZE_PROXY_SIZE 128
+
+static bool compareQuantizedColors(const QuantizedColor &a, const QuantizedColor &b) {
+  return a.count > b.count;
+}
+
+QuantizeColorsWorker::QuantizeColorsWorker(NanCallback *callback, int debug, Magick::Blob srcBlob, unsigned int colors):MagickWorker(callback, srcBlob) {
+  this->debug       = debug;
+  this->colors      = colors;
+  this->totalPixels = 0;
+}
+QuantizeColorsWorker::~QuantizeColorsWorker() {};
+void QuantizeColorsWorker::Execute() {
+  Magick::Image image;
+  try {
+    ReadImage(image, srcBlob, Magick::Geometry(QUANTIZE_PROXY_SIZE, QUANTIZE_PROXY_SIZE), srcFormat);
+  } catch (std::exception& err) {
+    message  = "image.read failed with error: ";
+    message += err.what();
+    this->errmsg = message.c_str();
+    return;
+  } catch (...) {
+    this->errmsg = "unhandled error";
+    return;
+  }
+
+  if (debug) printf("decoded width,height: %d, %d\n", (int) image.columns(), (int) image.rows());
+
+  std::map<Magick::Color, size_t> histogram;
+  try {
+    // other decoders ignore the size hint, shrink those ourselves
+    Magick::Geometry proxyGeometry(QUANTIZE_PROXY_SIZE, QUANTIZE_PROXY_SIZE);
+    proxyGeometry.greater(true);
+    image.scale(proxyGeometry);
+    if (debug) printf("proxy width,height: %d, %d\n", (int) image.columns(), (int) image.rows());
+
+    image.quantizeColors(colors);
+    image.quantizeDither(false);
+    image.quantize();
+
+    Magick::colorHistogram(&histogram, image);
+  } catch (std::exception& err) {
+    message  = "quantize failed with error: ";
+    message += err.what();
+    this->errmsg = message.c_str();
+    return;
+  } catch (...) {
+    this->errmsg = "unhandled error";
+    return;
+  }
+
+  totalPixels = image.columns() * image.rows();
+  for (std::map<Magick::Color, size_t>::const_iterator it = histogram.begin(); it != histogram.end(); ++it) {
+    QuantizedColor color;
+    color.r     = MagickCore::ScaleQuantumToChar(it->first.redQuantum());
+    color.g     = MagickCore::ScaleQuantumToChar(it->first.greenQuantum());
+    color.b     = MagickCore::ScaleQuantumToChar(it->first.blueQuantum());
+    color.count = it->second;
+    results.push_back(color);
+  }
+  std::sort(results.begin(), results.end(), compareQuantizedColors);
+  if (debug) printf("quantized to %d colors\n", (int) results.size());
+};
+void QuantizeColorsWorker::HandleOKCallback() {
+  NanScope();
+  Local<Array> out = Array::New(results.size());
+  for (size_t i = 0; i < results.size(); i++) {
+    char hex[7];
+    snprintf(hex, sizeof(hex), "%02x%02x%02x", results[i].r, results[i].g, results[i].b);
+
+    Local<Object> color = Object::New();
+    color->Set(NanSymbol("r"), Integer::New(results[i].r));
+    color->Set(NanSymbol("g"), Integer::New(results[i].g));
+    color->Set(NanSymbol("b"), Integer::New(results[i].b));
+    color->Set(NanSymbol("hex"), String::New(hex));
+    color->Set(NanSymbol("share"), Number::New(totalPixels ? (double)results[i].count / totalPixels : 0.));
+    out->Set(i, color);
+  }
+  Local<Value> argv[] = {Local<Value>::New(Undefined()), out};
+  callback->Call(2, argv);
+};
+///////////////////////////////////////////////////////////////////////////////////////////////////
+LoadWorker::LoadWorker(NanCallback *callback, int debug, Magick::Blob srcBlob):MagickWorker(callback, srcBlob) {
+  this->debug = debug;
+}
+LoadWorker::~LoadWorker() {};
+void LoadWorker::Execute() {
+  try {
+    ReadImage(image, srcBlob, srcFormat);
+  } catch (std::exception& err) {
+    message  = "image.read failed with error: ";
+    message += err.what();
+    this->errmsg = message.c_str();
+    return;
+  } catch (...) {
+    this->errmsg = "unhandled error";
+    return;
+  }
+  if (debug) printf("loaded width,height: %d, %d\n", (int) image.columns(), (int) image.rows());
+};
+void LoadWorker::HandleOKCallback() {
+  NanScope();
+  Local<Value> argv[] = {Local<Value>::New(Undefined()), ImageHandle::NewInstance(image)};
+  callback->Call(2, argv);
+};
+///////////////////////////////////////////////////////////////////////////////////////////////////
+RegisterOverlayWorker::RegisterOverlayWorker(NanCallback *callback, int debug, Magick::Blob srcBlob, const std::string &name, const std::string &gravity, double scale, const std::vector<unsigned int> &outputWidths):MagickWorker(callback, srcBlob) {
+  this->debug        = debug;
+  this->name         = name;
+  this->gravity      = gravity;
+  this->scale        = scale;
+  this->outputWidths = outputWidths;
+  this->overlay      = NULL;
+}
+RegisterOverlayWorker::~RegisterOverlayWorker() {
+  if (overlay)
+    DeleteOverlay(overlay);
+};
+void RegisterOverlayWorker::Execute() {
+  try {
+    overlay = DecodeOverlay(srcBlob, srcFormat, gravity.c_str(), scale, outputWidths);
+  } catch (std::exception& err) {
+    message  = "image.read failed with error: ";
+    message += err.what();
+    this->errmsg = message.c_str();
+    return;
+  } catch (...) {
+    this->errmsg = "unhandled error";
+    return;
+  }
+  if (debug) printf("overlay decoded: %s\n", name.c_str());
+};
+void RegisterOverlayWorker::HandleOKCallback() {
+  NanScope();
+  size_t releasedBytes;
+  size_t bytes = AddOverlay(name, overlay, &releasedBytes);
+  overlay = NULL;
+  AdjustNativeMemory(NATIVE_MEMORY_OVERLAYS, (ssize_t)bytes - (ssize_t)releasedBytes);
+
+  Local<Value> argv[] = {Local<Value>::New(Undefined())};
+  callback->Call(1, argv);
+};
+///////////////////////////////////////////////////////////////////////////////////////////////////
+ImageHandleWorker::ImageHandleWorker(NanCallback *callback, int debug, const Magick::Image &image, ImageHandleOperation operation, ImageHandleOptions options):MagickWorker(callback, Magick::Blob()) {
+  // shares pixels with the handle, the first modification clones them
+  this->image     = image;
+  this->debug     = debug;
+  this->operation = operation;
+  this->options   = options;
+}
+ImageHandleWorker::~ImageHandleWorker() {
+  if (options.resizeStyle)
+    delete[] options.resizeStyle;
+  if (options.format)
+    delete[] options.format;
+};
+void ImageHandleWorker::Execute() {
+  try {
+    switch (operation) {
+      case IMAGE_HANDLE_RESIZE:
+        this->errmsg = ResizeImage(image, options.width, options.height, options.resizeStyle ? options.resizeStyle : "aspectfill", NULL, debug);
+        break;
+      case IMAGE_HANDLE_CROP:
+        CropImage(image, options.pWidth, options.pHeight, options.pTop, options.pLeft, debug);
+        break;
+      case IMAGE_HANDLE_ORIENT:
+        OrientImage(image, debug);
+        break;
+      case IMAGE_HANDLE_ENCODE:
+        if (options.format)
+          image.magick(options.format);
+        if (options.quality)
+          image.quality(options.quality);
+        if (options.strip)
+          image.strip();
+        image.write(&dstBlob);
+        break;
+    }
+  } catch (std::exception& err) {
+    message  = "image operation failed with error: ";
+    message += err.what();
+    this->errmsg = message.c_str();
+  } catch (...) {
+    this->errmsg = "unhandled error";
+  }
+};
+void ImageHandleWorker::HandleOKCallback() {
+  NanScope();
+  Local<Value> result;
+  if (operation == IMAGE_HANDLE_ENCODE)
+    result = NativeMemoryBuffer(dstBlob);
+  else
+    result = ImageHandle::NewInstance(image);
+  Local<Value> argv[] = {Local<Value>::New(Undefined()), result};
+  callback->Call(2, argv);
+};
@@ -1,23 +1,75 @@
+#ifndef ASYNC_MAGICK_H
+#define ASYNC_MAGICK_H
+
 #include <Magick++.h>
+#include <string>
+#include <vector>
 #include "nan.h"
 using namespace node;
 using namespace v8;
 
-class ConvertWorker:public NanAsyncWorker {
+// base class for workers admitted against the global pixel/memory budget, see admission.h
+class MagickWorker:public NanAsyncWorker {
+  public:
+    MagickWorker(NanCallback *callback, Magick::Blob srcBlob);
+    ~MagickWorker();
+    void WorkComplete();
+    void HandleErrorCallback();
+    // fails the callback without running, for admission. the caller deletes the worker
+    void Reject(const std::string &error, const char *code);
+    const Magick::Blob &SourceBlob() const;
+    // estimated decoded byte size, reserved until the callback returns
+    size_t cost;
+    // cost of decoding a columns x rows source, set by admission once srcFormat is known
+    virtual size_t DecodedCost(size_t columns, size_t rows) const;
+    // decoder to read srcBlob with, "" for generic detection. see formats.h
+    std::string srcFormat;
+    // pixel limit for workers checking it themselves, 0: none. see RouteAndAdmitWorker
+    size_t maxPixels;
+    // holds one of the helper slots, see RouteAndAdmitWorker
+    bool inHelper;
+  protected:
+    // Error for errmsg, with err.code set to errcode if there is one
+    Local<Value> ErrorValue();
+    Magick::Blob srcBlob;
+    const char *errcode;
+  private:
+    std::string rejection;
+};
+
+class ConvertWorker:public MagickWorker {
   public:
-    ConvertWorker(NanCallback *callback, int debug, Magick::Blob srcBlob, unsigned int width, unsigned int height, unsigned int quality, const char *format, const char *resizeStyle);
+    ConvertWorker(NanCallback *callback, int debug, Magick::Blob srcBlob, unsigned int width, unsigned int height, unsigned int quality, const char *format, const char *resizeStyle, int analyze, unsigned int componentsX, unsigned int componentsY, const char *composite, int outOfProcess);
     ~ConvertWorker();
     void Execute();
+    void WorkComplete();
     void HandleOKCallback();
+    void HandleErrorCallback();
+    // registers this worker for identical jobs to join, see coalesce.h
+    void Coalesce(const std::string &key);
+    void AddWaiter(NanCallback *waiter);
+    bool SameSource(const char *data, size_t length) const;
   private:
+    void ExecuteInHelper();
+    std::string helperCode;
     int debug;
-    Magick::Blob srcBlob;
     Magick::Blob dstBlob;
     unsigned int width;
     unsigned int height;
     unsigned int quality;
     const char *format;
     const char *resizeStyle;
+    int analyze;
+    unsigned int componentsX;
+    unsigned int componentsY;
+    std::string phash;
+    std::string blurhash;
+    const char *composite;
+    int outOfProcess;
+    std::string message;
+    std::string coalesceKey;
+    // callbacks of coalesced jobs, called after callback with the same results
+    std::vector<NanCallback*> waiters;
 };
 
 class ConvertFileWorker:public NanAsyncWorker {
@@ -37,7 +89,7 @@ class ConvertFileWorker:public NanAsyncWorker {
     const char *resizeStyle;
 };
 
-class CropWorker:public NanAsyncWorker {
+class CropWorker:public MagickWorker {
   public:
     CropWorker(NanCallback *callback, int debug, Magick::Blob srcBlob, double pWidth, double pHeight, double pTop, double pLeft, unsigned int quality, const char *format);
     ~CropWorker();
@@ -45,7 +97,6 @@ class CropWorker:public NanAsyncWorker {
     void HandleOKCallback();
   private:
     int debug;
-    Magick::Blob srcBlob;
     Magick::Blob dstBlob;
     double pWidth;
     double pHeight;
@@ -53,9 +104,10 @@ class CropWorker:public NanAsyncWorker {
     double pLeft;
     unsigned int quality;
     const char *format;
+    std::string message;
 };
 
-class NormalizeWorker:public NanAsyncWorker {
+class NormalizeWorker:public MagickWorker {
   public:
     NormalizeWorker(NanCallback *callback, int debug, Magick::Blob srcBlob);
     ~NormalizeWorker();
@@ -63,14 +115,118 @@ class NormalizeWorker:public NanAsyncWorker {
     void HandleOKCallback();
   private:
     int debug;
-    Magick::Blob srcBlob;
     Magick::Blob dstBlob;
+    std::string message;
+};
+
+class IdentifyWorker:public MagickWorker {
+  public:
+    IdentifyWorker(NanCallback *callback, int debug, Magick::Blob srcBlob, int analyze, unsigned int componentsX, unsigned int componentsY);
+    ~IdentifyWorker();
+    void Execute();
+    void HandleOKCallback();
+  private:
+    int debug;
+    int analyze;
+    unsigned int componentsX;
+    unsigned int componentsY;
+    size_t width;
+    size_t height;
+    size_t depth;
+    std::string format;
+    std::string phash;
+    std::string blurhash;
+    std::string message;
+};
+
+struct QuantizedColor {
+  unsigned char r;
+  unsigned char g;
+  unsigned char b;
+  size_t count;
 };
 
-class QuantizeColorsWorker:public NanAsyncWorker {
+class QuantizeColorsWorker:public MagickWorker {
   public:
-    QuantizeColorsWorker(NanCallback *callback);
+    QuantizeColorsWorker(NanCallback *callback, int debug, Magick::Blob srcBlob, unsigned int colors);
     ~QuantizeColorsWorker();
     void Execute();
     void HandleOKCallback();
+  private:
+    int debug;
+    unsigned int colors;
+    std::vector<QuantizedColor> results;
+    size_t totalPixels;
+    std::string message;
+};
+
+class LoadWorker:public MagickWorker {
+  public:
+    LoadWorker(NanCallback *callback, int debug, Magick::Blob srcBlob);
+    ~LoadWorker();
+    void Execute();
+    void HandleOKCallback();
+  private:
+    int debug;
+    Magick::Image image;
+    std::string message;
+};
+
+struct Overlay;
+
+class RegisterOverlayWorker:public MagickWorker {
+  public:
+    RegisterOverlayWorker(NanCallback *callback, int debug, Magick::Blob srcBlob, const std::string &name, const std::string &gravity, double scale, const std::vector<unsigned int> &outputWidths);
+    ~RegisterOverlayWorker();
+    void Execute();
+    void HandleOKCallback();
+  private:
+    int debug;
+    std::string name;
+    std::string gravity;
+    double scale;
+    std::vector<unsigned int> outputWidths;
+    // decoded on the threadpool, registered on the main thread
+    Overlay *overlay;
+    std::string message;
+};
+
+enum ImageHandleOperation {
+  IMAGE_HANDLE_RESIZE,
+  IMAGE_HANDLE_CROP,
+  IMAGE_HANDLE_ORIENT,
+  IMAGE_HANDLE_ENCODE
+};
+
+// parameters of an ImageHandle operation, strings are owned by the worker
+struct ImageHandleOptions {
+  unsigned int width;
+  unsigned int height;
+  const char *resizeStyle;
+  double pWidth;
+  double pHeight;
+  double pTop;
+  double pLeft;
+  unsigned int quality;
+  const char *format;
+  int strip;
+};
+
+// runs one operation on a copy of an ImageHandle's image.
+// resize, crop and orient pass a new ImageHandle to the callback, encode a Buffer
+class ImageHandleWorker:public MagickWorker {
+  public:
+    ImageHandleWorker(NanCallback *callback, int debug, const Magick::Image &image, ImageHandleOperation operation, ImageHandleOptions options);
+    ~ImageHandleWorker();
+    void Execute();
+    void HandleOKCallback();
+  private:
+    int debug;
+    Magick::Image image;
+    ImageHandleOperation operation;
+    ImageHandleOptions options;
+    Magick::Blob dstBlob;
+    std::string message;
 };
+
+#endif // ASYNC_MAGICK_H
@@ -0,0 +1,76 @@
+#ifndef BUILDING_NODE_EXTENSION
+#define BUILDING_NODE_EXTENSION
+#endif  // BUILDING_NODE_EXTENSION
+
+#include "coalesce.h"
+#include <ctype.h>
+#include <map>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+static std::multimap<std::string, ConvertWorker*> inFlight;
+
+// multiply-xorshift over 8 byte words. only buckets sources, equal keys are verified with memcmp
+static uint64_t HashSource(const char *data, size_t length) {
+  const uint64_t m = 0x9E3779B97F4A7C15ULL;
+  uint64_t h = length * m;
+  size_t i = 0;
+  for (; i + 8 <= length; i += 8) {
+    uint64_t word;
+    memcpy(&word, data + i, 8);
+    h  = (h ^ word) * m;
+    h ^= h >> 32;
+  }
+  uint64_t tail = 0;
+  memcpy(&tail, data + i, length - i);
+  h  = (h ^ tail) * m;
+  h ^= h >> 29;
+  return h;
+}
+
+std::string CoalesceKey(const char *data, size_t length, const std::string &inputFormat, size_t maxPixels, unsigned int width, unsigned int height, unsigned int quality, const char *format, const char *resizeStyle, int analyze, unsigned int componentsX, unsigned int componentsY, const char *composite) {
+  // options that don't change the output are left out: resizeStyle without a size, components without analyze
+  std::string normalizedFormat;
+  for (const char *c = format ? format : ""; *c; c++)
+    normalizedFormat.push_back(toupper(*c));
+
+  char key[128];
+  snprintf(key, sizeof(key), "%016llx|%lu|%u|%u|%u|%d|%u|%u|", (unsigned long long) HashSource(data, length),
+           (unsigned long) maxPixels, width, height, quality, analyze, analyze ? componentsX : 0, analyze ? componentsY : 0);
+
+  std::string out = key;
+  out += inputFormat;
+  out += "|";
+  out += normalizedFormat;
+  out += "|";
+  if (width || height)
+    out += resizeStyle;
+  out += "|";
+  if (composite)
+    out += composite;
+  return out;
+}
+
+ConvertWorker *FindInFlight(const std::string &key, const char *data, size_t length) {
+  std::pair<std::multimap<std::string, ConvertWorker*>::iterator, std::multimap<std::string, ConvertWorker*>::iterator> range = inFlight.equal_range(key);
+  for (std::multimap<std::string, ConvertWorker*>::iterator it = range.first; it != range.second; ++it) {
+    if (it->second->SameSource(data, length))
+      return it->second;
+  }
+  return NULL;
+}
+
+void AddInFlight(const std::string &key, ConvertWorker *worker) {
+  inFlight.insert(std::make_pair(key, worker));
+}
+
+void RemoveInFlight(const std::string &key, ConvertWorker *worker) {
+  std::pair<std::multimap<std::string, ConvertWorker*>::iterator, std::multimap<std::string, ConvertWorker*>::iterator> range = inFlight.equal_range(key);
+  for (std::multimap<std::string, ConvertWorker*>::iterator it = range.first; it != range.second; ++it) {
+    if (it->second == worker) {
+      inFlight.erase(it);
+      return;
+    }
+  }
+}
@@ -0,0 +1,21 @@
+#ifndef COALESCE_H
+#define COALESCE_H
+
+#include "async_magick.h"
+
+// Identical convert() jobs queued or running at the same time share one ConvertWorker:
+// later callers are attached to it as waiters and get the same output Buffer.
+// Workers leave the registry when they complete, no results are kept.
+// All functions must be called from the main thread.
+
+// key of a convert() job: a hash of its source, its inputFormat hint, its maxPixels and its normalized options
+std::string CoalesceKey(const char *data, size_t length, const std::string &inputFormat, size_t maxPixels, unsigned int width, unsigned int height, unsigned int quality, const char *format, const char *resizeStyle, int analyze, unsigned int componentsX, unsigned int componentsY, const char *composite);
+
+// returns the queued or running worker for key whose source equals data, or NULL
+ConvertWorker *FindInFlight(const std::string &key, const char *data, size_t length);
+
+void AddInFlight(const std::string &key, ConvertWorker *worker);
+
+void RemoveInFlight(const std::string &key, ConvertWorker *worker);
+
+#endif // COALESCE_H
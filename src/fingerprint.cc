@@ -0,0 +1,154 @@
+#include "fingerprint.h"
+#include <math.h>
+#include <stdio.h>
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+// proxy size used for both hashes, BlurHash doesn't need more than this
+#define PROXY_SIZE 32
+
+// dHash compares 9 horizontally adjacent pixels in 8 rows => 64 bits
+#define DHASH_WIDTH  9
+#define DHASH_HEIGHT 8
+
+static const char base83Characters[] = "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz#$%*+,-.:;=?@[]^_{|}~";
+
+static void encode83(int value, int length, std::string *out) {
+  int divisor = 1;
+  for (int i = 1; i < length; i++)
+    divisor *= 83;
+  for (int i = 0; i < length; i++) {
+    out->push_back( base83Characters[ (value / divisor) % 83 ] );
+    divisor /= 83;
+  }
+}
+
+static double sRGBToLinear(unsigned char value) {
+  double v = (double)value / 255.;
+  if (v <= 0.04045)
+    return v / 12.92;
+  return pow( (v + 0.055) / 1.055, 2.4 );
+}
+
+static int linearTosRGB(double value) {
+  double v = value < 0. ? 0. : (value > 1. ? 1. : value);
+  if (v <= 0.0031308)
+    return (int)( v * 12.92 * 255. + 0.5 );
+  return (int)( (1.055 * pow(v, 1. / 2.4) - 0.055) * 255. + 0.5 );
+}
+
+static double signPow(double value, double exp) {
+  double ret = pow( fabs(value), exp );
+  return value < 0 ? -ret : ret;
+}
+
+static int quantizeAC(double value, double maximumValue) {
+  int q = (int)floor( signPow(value / maximumValue, 0.5) * 9. + 9.5 );
+  return q < 0 ? 0 : (q > 18 ? 18 : q);
+}
+
+static void blurHash(const unsigned char *rgb, unsigned int width, unsigned int height, unsigned int componentsX, unsigned int componentsY, std::string *out) {
+  double linear[ PROXY_SIZE * PROXY_SIZE * 3 ];
+  for (unsigned int i = 0; i < width * height * 3; i++)
+    linear[i] = sRGBToLinear( rgb[i] );
+
+  double factors[ 9 * 9 ][ 3 ];
+  for (unsigned int j = 0; j < componentsY; j++) {
+    double cosY[ PROXY_SIZE ];
+    for (unsigned int y = 0; y < height; y++)
+      cosY[y] = cos( M_PI * j * y / height );
+
+    for (unsigned int i = 0; i < componentsX; i++) {
+      double cosX[ PROXY_SIZE ];
+      for (unsigned int x = 0; x < width; x++)
+        cosX[x] = cos( M_PI * i * x / width );
+
+      double r = 0, g = 0, b = 0;
+      for (unsigned int y = 0; y < height; y++) {
+        for (unsigned int x = 0; x < width; x++) {
+          double basis = cosX[x] * cosY[y];
+          const double *p = linear + (y * width + x) * 3;
+          r += basis * p[0];
+          g += basis * p[1];
+          b += basis * p[2];
+        }
+      }
+      double normalisation = (i == 0 && j == 0) ? 1. : 2.;
+      double scale = normalisation / (width * height);
+      double *f = factors[ j * componentsX + i ];
+      f[0] = r * scale;
+      f[1] = g * scale;
+      f[2] = b * scale;
+    }
+  }
+
+  unsigned int acCount = componentsX * componentsY - 1;
+  encode83( (componentsX - 1) + (componentsY - 1) * 9, 1, out );
+
+  double maximumValue = 1.;
+  if (acCount > 0) {
+    double actualMaximum = 0.;
+    for (unsigned int i = 1; i <= acCount; i++)
+      for (int c = 0; c < 3; c++)
+        if (fabs(factors[i][c]) > actualMaximum)
+          actualMaximum = fabs(factors[i][c]);
+
+    int quantisedMaximum = (int)floor( actualMaximum * 166. - 0.5 );
+    quantisedMaximum = quantisedMaximum < 0 ? 0 : (quantisedMaximum > 82 ? 82 : quantisedMaximum);
+    maximumValue = (quantisedMaximum + 1) / 166.;
+    encode83( quantisedMaximum, 1, out );
+  } else {
+    encode83( 0, 1, out );
+  }
+
+  int dc = (linearTosRGB(factors[0][0]) << 16) + (linearTosRGB(factors[0][1]) << 8) + linearTosRGB(factors[0][2]);
+  encode83( dc, 4, out );
+
+  for (unsigned int i = 1; i <= acCount; i++) {
+    int ac = quantizeAC(factors[i][0], maximumValue) * 19 * 19
+           + quantizeAC(factors[i][1], maximumValue) * 19
+           + quantizeAC(factors[i][2], maximumValue);
+    encode83( ac, 2, out );
+  }
+}
+
+static void differenceHash(const unsigned char *gray, std::string *out) {
+  unsigned long long hash = 0;
+  for (int y = 0; y < DHASH_HEIGHT; y++) {
+    for (int x = 0; x < DHASH_WIDTH - 1; x++) {
+      hash <<= 1;
+      if (gray[ y * DHASH_WIDTH + x ] < gray[ y * DHASH_WIDTH + x + 1 ])
+        hash |= 1;
+    }
+  }
+  char hex[17];
+  snprintf( hex, sizeof(hex), "%016llx", hash );
+  *out = hex;
+}
+
+void AnalyzeImage(const Magick::Image &image, unsigned int componentsX, unsigned int componentsY, std::string *phash, std::string *blurhash) {
+  // copies share pixels with the decoded image until modified,
+  // and scale() is a cheap box filter, so the proxy costs one pass over the raster
+  Magick::Geometry proxyGeometry( PROXY_SIZE, PROXY_SIZE );
+  proxyGeometry.aspect( true );
+  Magick::Image proxy( image );
+  proxy.scale( proxyGeometry );
+
+  unsigned char rgb[ PROXY_SIZE * PROXY_SIZE * 3 ];
+  proxy.write( 0, 0, PROXY_SIZE, PROXY_SIZE, "RGB", Magick::CharPixel, rgb );
+
+  Magick::Geometry dhashGeometry( DHASH_WIDTH, DHASH_HEIGHT );
+  dhashGeometry.aspect( true );
+  Magick::Image small( proxy );
+  small.scale( dhashGeometry );
+
+  unsigned char gray[ DHASH_WIDTH * DHASH_HEIGHT ];
+  small.write( 0, 0, DHASH_WIDTH, DHASH_HEIGHT, "I", Magick::CharPixel, gray );
+
+  differenceHash( gray, phash );
+
+  blurhash->clear();
+  blurHash( rgb, PROXY_SIZE, PROXY_SIZE, componentsX, componentsY, blurhash );
+}
@@ -0,0 +1,15 @@
+#ifndef FINGERPRINT_H
+#define FINGERPRINT_H
+
+#include <Magick++.h>
+#include <string>
+
+#define BLURHASH_DEFAULT_COMPONENTS_X 4
+#define BLURHASH_DEFAULT_COMPONENTS_Y 3
+
+// computes a 64bit perceptual hash (dHash, as 16 hex chars) and a BlurHash string
+// from a small downsampled proxy of an already decoded image.
+// image is not modified, componentsX/Y should be between 1 and 9.
+void AnalyzeImage(const Magick::Image &image, unsigned int componentsX, unsigned int componentsY, std::string *phash, std::string *blurhash);
+
+#endif // FINGERPRINT_H
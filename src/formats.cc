@@ -0,0 +1,109 @@
+#include "formats.h"
+#include <ctype.h>
+#include <set>
+#include <stdio.h>
+#include <string.h>
+
+// enough for the longest signature, RIFF....WEBP
+#define SNIFF_LENGTH 12
+
+static std::set<std::string> allowedFormats;
+
+static std::string UpperCase(const char *s) {
+  std::string upper;
+  for (; *s; s++)
+    upper.push_back(toupper(*s));
+  return upper;
+}
+
+bool SetAllowedFormats(const std::vector<std::string> &formats, std::string *error) {
+  std::set<std::string> allowed;
+  for (size_t i = 0; i < formats.size(); i++) {
+    std::string format = UpperCase(formats[i].c_str());
+    MagickCore::ExceptionInfo exceptionInfo;
+    MagickCore::GetExceptionInfo(&exceptionInfo);
+    const MagickCore::MagickInfo *info = MagickCore::GetMagickInfo(format.c_str(), &exceptionInfo);
+    MagickCore::DestroyExceptionInfo(&exceptionInfo);
+    if (!info || !info->decoder) {
+      *error = "no decoder for format: " + format;
+      return false;
+    }
+    allowed.insert(format);
+  }
+  allowedFormats.swap(allowed);
+  return true;
+}
+
+const char *SniffFormat(const void *data, size_t length) {
+  const unsigned char *p = (const unsigned char*) data;
+  if (length >= 3 && p[0] == 0xFF && p[1] == 0xD8 && p[2] == 0xFF)
+    return "JPEG";
+  if (length >= 8 && memcmp(p, "\x89PNG\r\n\x1a\n", 8) == 0)
+    return "PNG";
+  if (length >= 6 && (memcmp(p, "GIF87a", 6) == 0 || memcmp(p, "GIF89a", 6) == 0))
+    return "GIF";
+  if (length >= 12 && memcmp(p, "RIFF", 4) == 0 && memcmp(p + 8, "WEBP", 4) == 0)
+    return "WEBP";
+  return NULL;
+}
+
+std::set<std::string> AllowedFormats() {
+  return allowedFormats;
+}
+
+bool RouteInputFormat(const std::set<std::string> &allowed, const void *data, size_t length, const char *hint, std::string *format, std::string *error) {
+  const char *sniffed = SniffFormat(data, length);
+  if (hint && *hint)
+    *format = UpperCase(hint);
+  else if (sniffed)
+    *format = sniffed;
+  else
+    format->clear();
+
+  if (allowed.empty())
+    return true;
+
+  // unknown inputs would need every coder's detection, which is what the allow list avoids
+  if (format->empty()) {
+    *error = "image format is not allowed";
+    return false;
+  }
+  if (!allowed.count(*format)) {
+    *error = "image format is not allowed: " + *format;
+    return false;
+  }
+  return true;
+}
+
+bool RouteInputFile(const std::set<std::string> &allowed, const char *path, const char *hint, std::string *format, std::string *error) {
+  unsigned char header[SNIFF_LENGTH];
+  size_t length = 0;
+  FILE *file = fopen(path, "rb");
+  if (file) {
+    length = fread(header, 1, sizeof(header), file);
+    fclose(file);
+  }
+  return RouteInputFormat(allowed, header, length, hint, format, error);
+}
+
+void ReadImage(Magick::Image &image, const Magick::Blob &blob, const std::string &format) {
+  // there's no read(blob, magick), a string would convert to the Geometry overload
+  if (!format.empty())
+    image.magick(format);
+  image.read(blob);
+}
+
+void ReadImageFile(Magick::Image &image, const std::string &path, const std::string &format) {
+  // an explicit "FORMAT:" prefix skips detection
+  if (format.empty())
+    image.read(path);
+  else
+    image.read(format + ":" + path);
+}
+
+void ReadImage(Magick::Image &image, const Magick::Blob &blob, const Magick::Geometry &size, const std::string &format) {
+  if (format.empty())
+    image.read(blob, size);
+  else
+    image.read(blob, size, format);
+}
@@ -0,0 +1,42 @@
+#ifndef FORMATS_H
+#define FORMATS_H
+
+#include <Magick++.h>
+#include <set>
+#include <string>
+#include <vector>
+
+// Inputs are routed to their decoder by a magic-byte sniff, or a caller's inputFormat hint,
+// instead of ImageMagick's generic format detection. Reads with an explicit format never
+// consult other coders, so with setAllowedFormats() only the allowed ones are ever loaded.
+//
+// SetAllowedFormats and AllowedFormats must be called from the main thread,
+// routing with the copied allow list works on any thread.
+
+// restricts inputs to formats, ex: "JPEG", "PNG". an empty list allows every format.
+// returns false and sets *error if ImageMagick doesn't know one of them
+bool SetAllowedFormats(const std::vector<std::string> &formats, std::string *error);
+
+// a copy of the allow list, empty allows every format
+std::set<std::string> AllowedFormats();
+
+// returns "JPEG", "PNG", "GIF" or "WEBP" from the first bytes of data, or NULL
+const char *SniffFormat(const void *data, size_t length);
+
+// sets *format to the decoder for data: the upper-cased hint (NULL: none), else the sniffed format,
+// else "" to let ImageMagick detect it. returns false and sets *error if that format isn't in allowed
+bool RouteInputFormat(const std::set<std::string> &allowed, const void *data, size_t length, const char *hint, std::string *format, std::string *error);
+
+// same as RouteInputFormat, sniffing the first bytes of a file
+bool RouteInputFile(const std::set<std::string> &allowed, const char *path, const char *hint, std::string *format, std::string *error);
+
+// reads blob with the decoder for format, "" for generic detection
+void ReadImage(Magick::Image &image, const Magick::Blob &blob, const std::string &format);
+
+// reads the file at path with the decoder for format, "" for generic detection
+void ReadImageFile(Magick::Image &image, const std::string &path, const std::string &format);
+
+// reads blob with the decoder for format, hinting the decoder to produce about size
+void ReadImage(Magick::Image &image, const Magick::Blob &blob, const Magick::Geometry &size, const std::string &format);
+
+#endif // FORMATS_H
@@ -0,0 +1,166 @@
+// imagemagick_helper: runs convert jobs for HelperPool in a separate process,
+// so a crashing delegate library only takes this process down.
+//
+//   imagemagick_helper <shared memory name> <memory limit in bytes, 0: none>
+//
+// the control socket is HELPER_CONTROL_FD, see helper_protocol.h
+
+#include <Magick++.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include "fingerprint.h"
+#include "formats.h"
+#include "helper_protocol.h"
+#include "image_ops.h"
+
+static int    shmFd   = -1;
+static void  *shm     = NULL;
+static size_t shmSize = 0;
+
+static bool Map(size_t size) {
+  if (shm)
+    munmap(shm, shmSize);
+  shm = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, shmFd, 0);
+  if (shm == MAP_FAILED) {
+    shm     = NULL;
+    shmSize = 0;
+    return false;
+  }
+  shmSize = size;
+  return true;
+}
+
+static void Convert(const HelperRequest &request, Magick::Blob *dstBlob, HelperResponse *response) {
+  Magick::Blob srcBlob(shm, request.srcLength);
+
+  // the pool's process only sniffs the magic bytes, the header is parsed here
+  if (request.maxPixels) {
+    Magick::Image header;
+    try {
+      if (request.inputFormat[0])
+        header.magick(request.inputFormat);
+      header.ping(srcBlob);
+    } catch (std::exception& err) {
+      snprintf(response->error, sizeof(response->error), "image.ping failed in helper with error: %s", err.what());
+      return;
+    } catch (...) {
+      snprintf(response->error, sizeof(response->error), "unhandled error");
+      return;
+    }
+    if (header.columns() * header.rows() > request.maxPixels) {
+      snprintf(response->error, sizeof(response->error), "image exceeds maxPixels: %dx%d", (int) header.columns(), (int) header.rows());
+      snprintf(response->code, sizeof(response->code), "EMAXPIXELS");
+      return;
+    }
+  }
+
+  Magick::Image image;
+  try {
+    ReadImage(image, srcBlob, request.inputFormat);
+  } catch (std::exception& err) {
+    snprintf(response->error, sizeof(response->error), "image.read failed in helper with error: %s", err.what());
+    return;
+  } catch (...) {
+    snprintf(response->error, sizeof(response->error), "unhandled error");
+    return;
+  }
+
+  try {
+    if (request.analyze) {
+      std::string phash, blurhash;
+      AnalyzeImage(image, request.componentsX, request.componentsY, &phash, &blurhash);
+      snprintf(response->phash, sizeof(response->phash), "%s", phash.c_str());
+      snprintf(response->blurhash, sizeof(response->blurhash), "%s", blurhash.c_str());
+    }
+
+    const char *format = request.format[0] ? request.format : NULL;
+    if (format)
+      image.magick(format);
+
+    if (request.width || request.height) {
+      const char *error = ResizeImage(image, request.width, request.height, request.resizeStyle, format, request.debug);
+      if (error) {
+        snprintf(response->error, sizeof(response->error), "%s", error);
+        return;
+      }
+    }
+
+    if (request.quality)
+      image.quality(request.quality);
+
+    image.write(dstBlob);
+  } catch (std::exception& err) {
+    snprintf(response->error, sizeof(response->error), "convert failed in helper with error: %s", err.what());
+    return;
+  } catch (...) {
+    snprintf(response->error, sizeof(response->error), "unhandled error");
+    return;
+  }
+  response->ok = 1;
+}
+
+int main(int argc, char **argv) {
+  if (argc < 3) {
+    fprintf(stderr, "usage: %s <shared memory name> <memory limit>\n", argv[0]);
+    return 2;
+  }
+
+  size_t memoryLimit = strtoull(argv[2], NULL, 10);
+  if (memoryLimit) {
+    struct rlimit limit;
+    limit.rlim_cur = memoryLimit;
+    limit.rlim_max = memoryLimit;
+    setrlimit(RLIMIT_AS, &limit);
+  }
+
+  shmFd = shm_open(argv[1], O_RDWR, 0600);
+  if (shmFd < 0) {
+    perror("shm_open");
+    return 1;
+  }
+
+  Magick::InitializeMagick(argv[0]);
+  MagickCore::SetMagickResourceLimit(MagickCore::ThreadResource, 1);
+  if (memoryLimit)
+    MagickCore::SetMagickResourceLimit(MagickCore::MemoryResource, memoryLimit / 2);
+
+  // warm and ready, the pool unlinks the segment name now
+  char ready = 1;
+  if (!WriteFull(HELPER_CONTROL_FD, &ready, 1))
+    return 1;
+
+  HelperRequest request;
+  while (ReadFull(HELPER_CONTROL_FD, &request, sizeof(request))) {
+    HelperResponse response;
+    memset(&response, 0, sizeof(response));
+
+    if (request.shmSize != shmSize && !Map(request.shmSize))
+      return 1;
+
+    Magick::Blob dstBlob;
+    Convert(request, &dstBlob, &response);
+
+    if (response.ok) {
+      if (dstBlob.length() > shmSize) {
+        // grow the segment, the pool maps the new size from the response
+        if (ftruncate(shmFd, dstBlob.length()) != 0 || !Map(dstBlob.length())) {
+          snprintf(response.error, sizeof(response.error), "growing shared memory failed");
+          response.ok = 0;
+        }
+      }
+      if (response.ok) {
+        memcpy(shm, dstBlob.data(), dstBlob.length());
+        response.dstLength = dstBlob.length();
+      }
+    }
+    response.shmSize = shmSize;
+
+    if (!WriteFull(HELPER_CONTROL_FD, &response, sizeof(response)))
+      return 1;
+  }
+  return 0;
+}
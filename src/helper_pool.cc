@@ -0,0 +1,332 @@
+#include "helper_pool.h"
+
+#ifndef _WIN32
+
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <uv.h>
+#include <vector>
+
+extern char **environ;
+
+// initial shared memory per helper, grown on demand
+#define HELPER_INITIAL_SHM_SIZE (4 * 1024 * 1024)
+
+struct Helper {
+  pid_t pid;
+  int fd;       // control socket, -1 when the helper is not running
+  int shmFd;
+  void *shm;
+  size_t shmSize;
+  bool busy;
+};
+
+static uv_mutex_t poolMutex;
+static uv_cond_t poolIdle;
+static std::vector<Helper*> helpers;
+static std::string helperExecutable;
+static size_t helperMemoryLimit = 0;
+static unsigned int helperTimeout = 0;
+static unsigned int spawnCount  = 0;
+
+static bool Map(Helper *helper, size_t size) {
+  if (helper->shm)
+    munmap(helper->shm, helper->shmSize);
+  helper->shm = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, helper->shmFd, 0);
+  if (helper->shm == MAP_FAILED) {
+    helper->shm     = NULL;
+    helper->shmSize = 0;
+    return false;
+  }
+  helper->shmSize = size;
+  return true;
+}
+
+// reaps a helper whose control socket failed. returns a description of how it exited
+static std::string Reap(Helper *helper) {
+  close(helper->fd);
+  helper->fd = -1;
+  if (helper->shm)
+    munmap(helper->shm, helper->shmSize);
+  helper->shm     = NULL;
+  helper->shmSize = 0;
+  close(helper->shmFd);
+  helper->shmFd = -1;
+
+  // the socket only fails if the helper is gone or misbehaving, make sure it's gone
+  kill(helper->pid, SIGKILL);
+  int status = 0;
+  waitpid(helper->pid, &status, 0);
+
+  char description[64];
+  if (WIFSIGNALED(status))
+    snprintf(description, sizeof(description), "helper process crashed with signal %d", WTERMSIG(status));
+  else
+    snprintf(description, sizeof(description), "helper process exited with status %d", WEXITSTATUS(status));
+  return description;
+}
+
+// ReadFull, giving up when the helper doesn't answer within helperTimeout ms (0: never).
+// sets *timedOut then
+static bool ReadResponse(Helper *helper, HelperResponse *response, bool *timedOut) {
+  *timedOut = false;
+  if (!helperTimeout)
+    return ReadFull(helper->fd, response, sizeof(*response));
+
+  uint64_t deadline = uv_hrtime() + (uint64_t) helperTimeout * 1000000;
+  char *p = (char*) response;
+  size_t length = sizeof(*response);
+  while (length) {
+    uint64_t now = uv_hrtime();
+    if (now >= deadline) {
+      *timedOut = true;
+      return false;
+    }
+    struct pollfd pfd;
+    pfd.fd     = helper->fd;
+    pfd.events = POLLIN;
+    int ready = poll(&pfd, 1, (int) ((deadline - now + 999999) / 1000000));
+    if (ready < 0 && errno == EINTR)
+      continue;
+    if (ready < 0)
+      return false;
+    if (ready == 0)
+      continue;
+
+    ssize_t n = read(helper->fd, p, length);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    p      += n;
+    length -= n;
+  }
+  return true;
+}
+
+static bool Spawn(Helper *helper, std::string *error) {
+  char shmName[64];
+  snprintf(shmName, sizeof(shmName), "/imagemagick-native-%d-%u", (int) getpid(), __sync_fetch_and_add(&spawnCount, 1));
+
+  // shm_open sets FD_CLOEXEC, so other helpers don't inherit the segment
+  helper->shmFd = shm_open(shmName, O_CREAT | O_EXCL | O_RDWR, 0600);
+  if (helper->shmFd < 0) {
+    *error = "shm_open failed";
+    return false;
+  }
+  helper->shm = NULL;
+  if (ftruncate(helper->shmFd, HELPER_INITIAL_SHM_SIZE) != 0 || !Map(helper, HELPER_INITIAL_SHM_SIZE)) {
+    *error = "shared memory setup failed";
+    close(helper->shmFd);
+    shm_unlink(shmName);
+    return false;
+  }
+
+  int sockets[2];
+#ifdef SOCK_CLOEXEC
+  int ret = socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sockets);
+#else
+  int ret = socketpair(AF_UNIX, SOCK_STREAM, 0, sockets);
+  if (ret == 0) {
+    fcntl(sockets[0], F_SETFD, FD_CLOEXEC);
+    fcntl(sockets[1], F_SETFD, FD_CLOEXEC);
+  }
+#endif
+  if (ret != 0) {
+    *error = "socketpair failed";
+    munmap(helper->shm, helper->shmSize);
+    close(helper->shmFd);
+    shm_unlink(shmName);
+    return false;
+  }
+
+  char limit[32];
+  snprintf(limit, sizeof(limit), "%lu", (unsigned long) helperMemoryLimit);
+  char *argv[] = { (char*) helperExecutable.c_str(), shmName, limit, NULL };
+
+  // dup2 clears FD_CLOEXEC on the helper's end
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init(&actions);
+  posix_spawn_file_actions_adddup2(&actions, sockets[1], HELPER_CONTROL_FD);
+  ret = posix_spawn(&helper->pid, helperExecutable.c_str(), &actions, NULL, argv, environ);
+  posix_spawn_file_actions_destroy(&actions);
+  close(sockets[1]);
+
+  char ready = 0;
+  helper->fd = sockets[0];
+  if (ret != 0 || !ReadFull(helper->fd, &ready, 1)) {
+    if (ret == 0) {
+      *error = Reap(helper);
+    } else {
+      *error = "posix_spawn failed: " + helperExecutable;
+      close(helper->fd);
+      helper->fd = -1;
+      munmap(helper->shm, helper->shmSize);
+      helper->shm = NULL;
+      close(helper->shmFd);
+      helper->shmFd = -1;
+    }
+    shm_unlink(shmName);
+    return false;
+  }
+
+  // both sides hold the segment open, the name isn't needed anymore
+  shm_unlink(shmName);
+  return true;
+}
+
+// imagemagick_helper is built next to this addon
+static std::string DefaultHelperPath() {
+  Dl_info info;
+  if (!dladdr((void*) &DefaultHelperPath, &info) || !info.dli_fname)
+    return "imagemagick_helper";
+  std::string path = info.dli_fname;
+  size_t slash = path.rfind('/');
+  return (slash == std::string::npos ? std::string(".") : path.substr(0, slash)) + "/imagemagick_helper";
+}
+
+static Helper *Acquire() {
+  uv_mutex_lock(&poolMutex);
+  for (;;) {
+    for (size_t i = 0; i < helpers.size(); i++) {
+      if (!helpers[i]->busy) {
+        helpers[i]->busy = true;
+        uv_mutex_unlock(&poolMutex);
+        return helpers[i];
+      }
+    }
+    uv_cond_wait(&poolIdle, &poolMutex);
+  }
+}
+
+static void Release(Helper *helper) {
+  uv_mutex_lock(&poolMutex);
+  helper->busy = false;
+  uv_cond_signal(&poolIdle);
+  uv_mutex_unlock(&poolMutex);
+}
+
+bool StartHelperPool(unsigned int size, size_t memoryLimit, unsigned int timeout, const char *helperPath, std::string *error) {
+  if (!helpers.empty()) {
+    *error = "worker pool is already started";
+    return false;
+  }
+
+  helperExecutable  = helperPath ? helperPath : DefaultHelperPath();
+  helperMemoryLimit = memoryLimit;
+  helperTimeout     = timeout;
+
+  std::vector<Helper*> spawned;
+  for (unsigned int i = 0; i < size; i++) {
+    Helper *helper = new Helper();
+    memset(helper, 0, sizeof(Helper));
+    if (!Spawn(helper, error)) {
+      delete helper;
+      for (size_t j = 0; j < spawned.size(); j++) {
+        Reap(spawned[j]);
+        delete spawned[j];
+      }
+      return false;
+    }
+    spawned.push_back(helper);
+  }
+
+  uv_mutex_init(&poolMutex);
+  uv_cond_init(&poolIdle);
+  helpers = spawned;
+  return true;
+}
+
+bool HelperPoolStarted() {
+  return !helpers.empty();
+}
+
+unsigned int HelperPoolSize() {
+  return helpers.size();
+}
+
+bool RunInHelper(const HelperRequest &request, const Magick::Blob &srcBlob, Magick::Blob *dstBlob, HelperResponse *response, std::string *error) {
+  Helper *helper = Acquire();
+
+  // restart a helper that crashed and couldn't be respawned right away
+  if (helper->fd < 0 && !Spawn(helper, error)) {
+    Release(helper);
+    return false;
+  }
+
+  if (srcBlob.length() > helper->shmSize) {
+    if (ftruncate(helper->shmFd, srcBlob.length()) != 0 || !Map(helper, srcBlob.length())) {
+      *error = "growing shared memory failed";
+      Reap(helper);
+      Release(helper);
+      return false;
+    }
+  }
+  memcpy(helper->shm, srcBlob.data(), srcBlob.length());
+
+  HelperRequest sent = request;
+  sent.shmSize   = helper->shmSize;
+  sent.srcLength = srcBlob.length();
+
+  bool timedOut = false;
+  if (!WriteFull(helper->fd, &sent, sizeof(sent)) || !ReadResponse(helper, response, &timedOut)) {
+    // a helper stuck in a decoder is killed like a crashed one
+    *error = Reap(helper);
+    if (timedOut) {
+      char description[64];
+      snprintf(description, sizeof(description), "helper process timed out after %u ms", helperTimeout);
+      *error = description;
+    }
+    // respawn now, so the next job finds a warm helper
+    std::string ignored;
+    Spawn(helper, &ignored);
+    Release(helper);
+    return false;
+  }
+
+  if (response->shmSize != helper->shmSize && !Map(helper, response->shmSize)) {
+    *error = "mapping shared memory failed";
+    Reap(helper);
+    Release(helper);
+    return false;
+  }
+
+  if (!response->ok) {
+    *error = response->error;
+    Release(helper);
+    return false;
+  }
+
+  *dstBlob = Magick::Blob(helper->shm, response->dstLength);
+  Release(helper);
+  return true;
+}
+
+#else // _WIN32
+
+bool StartHelperPool(unsigned int size, size_t memoryLimit, unsigned int timeout, const char *helperPath, std::string *error) {
+  *error = "worker pool is not supported on this platform";
+  return false;
+}
+
+bool HelperPoolStarted() {
+  return false;
+}
+
+unsigned int HelperPoolSize() {
+  return 0;
+}
+
+bool RunInHelper(const HelperRequest &request, const Magick::Blob &srcBlob, Magick::Blob *dstBlob, HelperResponse *response, std::string *error) {
+  *error = "worker pool is not supported on this platform";
+  return false;
+}
+
+#endif // _WIN32
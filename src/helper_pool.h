@@ -0,0 +1,30 @@
+#ifndef HELPER_POOL_H
+#define HELPER_POOL_H
+
+#include <Magick++.h>
+#include <string>
+#include "helper_protocol.h"
+
+// A pool of pre-spawned imagemagick_helper processes running convert jobs out of process.
+// A crashing helper fails only the job it was running and is respawned.
+// Input and output go through a shared memory segment per helper.
+// POSIX only.
+
+// spawns size helpers on the calling thread. helperPath NULL uses imagemagick_helper next to this addon.
+// memoryLimit (0: none) limits each helper's address space.
+// a helper not answering a job within timeout ms (0: none) is killed and respawned.
+// returns false and sets *error if a helper fails to start or the pool is already started
+bool StartHelperPool(unsigned int size, size_t memoryLimit, unsigned int timeout, const char *helperPath, std::string *error);
+
+bool HelperPoolStarted();
+
+// number of helpers, 0 before the pool is started
+unsigned int HelperPoolSize();
+
+// runs request on srcBlob in an idle helper, blocking until it answers or times out.
+// waits for a helper if all are busy, admission dispatches at most HelperPoolSize() jobs to avoid that.
+// to be called on threadpool threads. returns false and sets *error on failures,
+// including the helper crashing or timing out.
+bool RunInHelper(const HelperRequest &request, const Magick::Blob &srcBlob, Magick::Blob *dstBlob, HelperResponse *response, std::string *error);
+
+#endif // HELPER_POOL_H
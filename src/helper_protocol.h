@@ -0,0 +1,86 @@
+#ifndef HELPER_PROTOCOL_H
+#define HELPER_PROTOCOL_H
+
+#include <stddef.h>
+
+// Messages exchanged between HelperPool and imagemagick_helper over a control socket.
+// Image data never goes through the socket: the input is placed at the start of a shared
+// memory segment, and the helper replaces it with the output, growing the segment if needed.
+
+// the helper's end of the control socket
+#define HELPER_CONTROL_FD 3
+
+#define HELPER_STRING_SIZE   32
+#define HELPER_BLURHASH_SIZE 192
+#define HELPER_ERROR_SIZE    256
+#define HELPER_CODE_SIZE     16
+
+struct HelperRequest {
+  size_t shmSize;   // size of the segment as the pool mapped it
+  size_t srcLength; // input bytes at the start of the segment
+  unsigned int width;
+  unsigned int height;
+  unsigned int quality;
+  int analyze;
+  unsigned int componentsX;
+  unsigned int componentsY;
+  int debug;
+  char format[HELPER_STRING_SIZE];      // empty keeps the input format
+  char resizeStyle[HELPER_STRING_SIZE];
+  char inputFormat[HELPER_STRING_SIZE]; // decoder routed by the pool's process, empty for generic detection
+  size_t maxPixels; // 0: none. the helper pings the header and fails larger images
+};
+
+struct HelperResponse {
+  int ok;
+  size_t shmSize;   // size of the segment, larger than requested if the output didn't fit
+  size_t dstLength; // output bytes at the start of the segment
+  char phash[17];
+  char blurhash[HELPER_BLURHASH_SIZE];
+  char error[HELPER_ERROR_SIZE];
+  char code[HELPER_CODE_SIZE]; // err.code, ex: "EMAXPIXELS", empty for none
+};
+
+#ifndef _WIN32
+
+#include <errno.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// both return false on EOF or errors, a closed socket means the other side is gone
+static inline bool ReadFull(int fd, void *buffer, size_t length) {
+  char *p = (char*) buffer;
+  while (length) {
+    ssize_t n = read(fd, p, length);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    p      += n;
+    length -= n;
+  }
+  return true;
+}
+
+static inline bool WriteFull(int fd, const void *buffer, size_t length) {
+  const char *p = (const char*) buffer;
+#ifdef MSG_NOSIGNAL
+  int flags = MSG_NOSIGNAL;
+#else
+  int flags = 0;
+#endif
+  while (length) {
+    ssize_t n = send(fd, p, length, flags);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    p      += n;
+    length -= n;
+  }
+  return true;
+}
+
+#endif // _WIN32
+
+#endif // HELPER_PROTOCOL_H
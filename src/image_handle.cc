@@ -0,0 +1,215 @@
+#ifndef BUILDING_NODE_EXTENSION
+#define BUILDING_NODE_EXTENSION
+#endif  // BUILDING_NODE_EXTENSION
+
+#include "image_handle.h"
+#include "admission.h"
+#include "native_memory.h"
+#include <map>
+#include <string.h>
+
+Persistent<FunctionTemplate> ImageHandle::constructor;
+
+// handles per pixel buffer. handles sharing pixels, ex: orient() of an upright image,
+// are charged once, by the first of them
+static std::map<const MagickCore::Image*, unsigned int> sharedPixels;
+
+ImageHandle::ImageHandle(const Magick::Image &image):image(image) {
+  this->bytes    = image.columns() * image.rows() * sizeof(Magick::PixelPacket);
+  this->disposed = false;
+  if (sharedPixels[ this->image.constImage() ]++ == 0)
+    AdjustNativeMemory(NATIVE_MEMORY_HANDLES, bytes);
+}
+ImageHandle::~ImageHandle() {
+  Release();
+}
+void ImageHandle::Release() {
+  if (disposed)
+    return;
+  disposed = true;
+  std::map<const MagickCore::Image*, unsigned int>::iterator it = sharedPixels.find(image.constImage());
+  if (--it->second == 0) {
+    sharedPixels.erase(it);
+    AdjustNativeMemory(NATIVE_MEMORY_HANDLES, -(ssize_t)bytes);
+  }
+  // running operations hold their own reference to the pixels
+  image = Magick::Image();
+}
+
+void ImageHandle::Init() {
+  Local<FunctionTemplate> tpl = FunctionTemplate::New(New);
+  tpl->SetClassName(NanSymbol("ImageHandle"));
+  tpl->InstanceTemplate()->SetInternalFieldCount(1);
+  NODE_SET_PROTOTYPE_METHOD(tpl, "resize", Resize);
+  NODE_SET_PROTOTYPE_METHOD(tpl, "crop", Crop);
+  NODE_SET_PROTOTYPE_METHOD(tpl, "orient", Orient);
+  NODE_SET_PROTOTYPE_METHOD(tpl, "encode", Encode);
+  NODE_SET_PROTOTYPE_METHOD(tpl, "dispose", Dispose);
+  NanAssignPersistent(FunctionTemplate, constructor, tpl);
+}
+
+Local<Object> ImageHandle::NewInstance(const Magick::Image &image) {
+  Magick::Image copy(image);
+  Local<Value> argv[] = {External::New(&copy)};
+  return NanPersistentToLocal(constructor)->GetFunction()->NewInstance(1, argv);
+}
+
+NAN_METHOD(ImageHandle::New) {
+  NanScope();
+
+  if (args.Length() != 1 || !args[0]->IsExternal())
+    return NanThrowError("ImageHandle can't be constructed directly, use load()");
+
+  Magick::Image *image = static_cast<Magick::Image*>(Local<External>::Cast(args[0])->Value());
+  ImageHandle *handle = new ImageHandle(*image);
+  handle->Wrap(args.This());
+
+  args.This()->Set(NanSymbol("width"), Integer::New(image->columns()));
+  args.This()->Set(NanSymbol("height"), Integer::New(image->rows()));
+  args.This()->Set(NanSymbol("format"), String::New(image->magick().c_str()));
+  NanReturnValue(args.This());
+}
+
+// queues operation on a copy of the handle's image
+static void QueueOperation(const Magick::Image &image, size_t cost, Local<Value> callbackValue, int debug, ImageHandleOperation operation, ImageHandleOptions options) {
+  NanCallback *callback = new NanCallback(callbackValue.As<Function>());
+  ImageHandleWorker *worker = new ImageHandleWorker(callback, debug, image, operation, options);
+  worker->cost = cost;
+  AdmitWorker(worker);
+}
+
+static ImageHandleOptions EmptyOptions() {
+  ImageHandleOptions options;
+  memset(&options, 0, sizeof(options));
+  return options;
+}
+
+// input
+//   args[ 0 ]: options. required, object with following key,values
+//              {
+//                  width:       optional. px.
+//                  height:      optional. px.
+//                  resizeStyle: optional. default: "aspectfill". can be "aspectfit", "fill"
+//                  debug:       optional. 1 or 0
+//              }
+//   args[ 1 ]: callback(err, resizedHandle)
+NAN_METHOD(ImageHandle::Resize) {
+  NanScope();
+  ImageHandle *handle = ObjectWrap::Unwrap<ImageHandle>(args.This());
+
+  if (handle->disposed)
+    return NanThrowError("ImageHandle is disposed");
+
+  if (args.Length() != 2 || !args[0]->IsObject() || !args[1]->IsFunction())
+    return NanThrowError("resize() requires one option argument and one callback argument!");
+
+  Local<Object> obj = Local<Object>::Cast(args[0]);
+  ImageHandleOptions options = EmptyOptions();
+  options.width  = obj->Get(NanSymbol("width"))->Uint32Value();
+  options.height = obj->Get(NanSymbol("height"))->Uint32Value();
+
+  Local<Value> resizeStyleValue = obj->Get(NanSymbol("resizeStyle"));
+  if (!resizeStyleValue->IsUndefined()) {
+    size_t count;
+    options.resizeStyle = NanCString(resizeStyleValue, &count);
+  }
+
+  int debug = NanUInt32OptionValue(obj, NanSymbol("debug"), 0);
+  QueueOperation(handle->image, handle->bytes, args[1], debug, IMAGE_HANDLE_RESIZE, options);
+  NanReturnUndefined();
+}
+
+// input
+//   args[ 0 ]: options. required, object with following key,values
+//              {
+//                  left:        required. 0-1 defines left corner crop position
+//                  top:         required. 0-1 defines top corner crop position
+//                  width:       required. 0-1 defines crop width
+//                  height:      required. 0-1 defines crop height
+//                  debug:       optional. 1 or 0
+//              }
+//   args[ 1 ]: callback(err, croppedHandle)
+NAN_METHOD(ImageHandle::Crop) {
+  NanScope();
+  ImageHandle *handle = ObjectWrap::Unwrap<ImageHandle>(args.This());
+
+  if (handle->disposed)
+    return NanThrowError("ImageHandle is disposed");
+
+  if (args.Length() != 2 || !args[0]->IsObject() || !args[1]->IsFunction())
+    return NanThrowError("crop() requires one option argument and one callback argument!");
+
+  Local<Object> obj = Local<Object>::Cast(args[0]);
+  ImageHandleOptions options = EmptyOptions();
+  options.pWidth  = obj->Get(NanSymbol("width"))->NumberValue();
+  options.pHeight = obj->Get(NanSymbol("height"))->NumberValue();
+  options.pTop    = obj->Get(NanSymbol("top"))->NumberValue();
+  options.pLeft   = obj->Get(NanSymbol("left"))->NumberValue();
+
+  if (!(options.pWidth >= 0 && options.pWidth <= 1 && options.pHeight >= 0 && options.pHeight <= 1 &&
+        options.pTop >= 0 && options.pTop <= 1 && options.pLeft >= 0 && options.pLeft <= 1))
+    return NanThrowError("\"width\", \"height\", \"top\" and \"left\" should be Numbers with the value between 0 and 1");
+
+  int debug = NanUInt32OptionValue(obj, NanSymbol("debug"), 0);
+  QueueOperation(handle->image, handle->bytes, args[1], debug, IMAGE_HANDLE_CROP, options);
+  NanReturnUndefined();
+}
+
+// input
+//   args[ 0 ]: callback(err, orientedHandle), rotated/flipped according to EXIF:Orientation
+NAN_METHOD(ImageHandle::Orient) {
+  NanScope();
+  ImageHandle *handle = ObjectWrap::Unwrap<ImageHandle>(args.This());
+
+  if (handle->disposed)
+    return NanThrowError("ImageHandle is disposed");
+
+  if (args.Length() != 1 || !args[0]->IsFunction())
+    return NanThrowError("orient() requires one callback argument!");
+
+  QueueOperation(handle->image, handle->bytes, args[0], 0, IMAGE_HANDLE_ORIENT, EmptyOptions());
+  NanReturnUndefined();
+}
+
+// input
+//   args[ 0 ]: options. required, object with following key,values
+//              {
+//                  format:      optional. one of http://www.imagemagick.org/script/formats.php ex: "JPEG"
+//                  quality:     optional. 0-100 integer, default 75. JPEG/MIFF/PNG compression level.
+//                  strip:       optional. 1 or 0, removes profiles and comments
+//                  debug:       optional. 1 or 0
+//              }
+//   args[ 1 ]: callback(err, buffer)
+NAN_METHOD(ImageHandle::Encode) {
+  NanScope();
+  ImageHandle *handle = ObjectWrap::Unwrap<ImageHandle>(args.This());
+
+  if (handle->disposed)
+    return NanThrowError("ImageHandle is disposed");
+
+  if (args.Length() != 2 || !args[0]->IsObject() || !args[1]->IsFunction())
+    return NanThrowError("encode() requires one option argument and one callback argument!");
+
+  Local<Object> obj = Local<Object>::Cast(args[0]);
+  ImageHandleOptions options = EmptyOptions();
+  options.quality = obj->Get(NanSymbol("quality"))->Uint32Value();
+  options.strip   = NanUInt32OptionValue(obj, NanSymbol("strip"), 0);
+
+  Local<Value> formatValue = obj->Get(NanSymbol("format"));
+  if (!formatValue->IsUndefined()) {
+    size_t count;
+    options.format = NanCString(formatValue, &count);
+  }
+
+  int debug = NanUInt32OptionValue(obj, NanSymbol("debug"), 0);
+  QueueOperation(handle->image, handle->bytes, args[1], debug, IMAGE_HANDLE_ENCODE, options);
+  NanReturnUndefined();
+}
+
+// frees the decoded image now instead of when the handle is garbage collected
+NAN_METHOD(ImageHandle::Dispose) {
+  NanScope();
+  ImageHandle *handle = ObjectWrap::Unwrap<ImageHandle>(args.This());
+  handle->Release();
+  NanReturnUndefined();
+}
@@ -0,0 +1,36 @@
+#ifndef IMAGE_HANDLE_H
+#define IMAGE_HANDLE_H
+
+#include <Magick++.h>
+#include <node.h>
+#include "nan.h"
+using namespace node;
+using namespace v8;
+
+// a decoded image kept in native memory, returned by load().
+// operations run on copies which share pixels with the handle until modified,
+// so the handle itself never changes and can be used by concurrent operations.
+class ImageHandle:public ObjectWrap {
+  public:
+    static void Init();
+    static Local<Object> NewInstance(const Magick::Image &image);
+  private:
+    ImageHandle(const Magick::Image &image);
+    ~ImageHandle();
+    void Release();
+
+    static NAN_METHOD(New);
+    static NAN_METHOD(Resize);
+    static NAN_METHOD(Crop);
+    static NAN_METHOD(Orient);
+    static NAN_METHOD(Encode);
+    static NAN_METHOD(Dispose);
+
+    static Persistent<FunctionTemplate> constructor;
+
+    Magick::Image image;
+    size_t bytes;
+    bool disposed;
+};
+
+#endif // IMAGE_HANDLE_H
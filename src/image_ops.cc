@@ -0,0 +1,137 @@
+#include "image_ops.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+const char *ResizeImage(Magick::Image &image, unsigned int width, unsigned int height, const char *resizeStyle, const char *format, int debug) {
+  if (!width)
+    width  = image.columns();
+  if (!height)
+    height = image.rows();
+
+  // do resize
+  if ( strcmp( resizeStyle, "aspectfill" ) == 0 ) {
+    // ^ : Fill Area Flag ('^' flag)
+    // is not implemented in Magick++
+    // and gravity: center, extent doesnt look like working as exptected
+    // so we do it ourselves
+
+    // keep aspect ratio, get the exact provided size, crop top/bottom or left/right if necessary
+    double aspectratioExpected = (double)height / (double)width;
+    double aspectratioOriginal = (double)image.rows() / (double)image.columns();
+    unsigned int xoffset = 0;
+    unsigned int yoffset = 0;
+    unsigned int resizewidth;
+    unsigned int resizeheight;
+
+    if ( aspectratioExpected > aspectratioOriginal ) {
+      // expected is taller
+      resizewidth  = (unsigned int)( (double)height / (double)image.rows() * (double)image.columns() + 1. );
+      resizeheight = height;
+      xoffset      = (unsigned int)( (resizewidth - width) / 2. );
+      yoffset      = 0;
+    } else {
+      // expected is wider
+      resizewidth  = width;
+      resizeheight = (unsigned int)( (double)width / (double)image.columns() * (double)image.rows() + 1. );
+      xoffset      = 0;
+      yoffset      = (unsigned int)( (resizeheight - height) / 2. );
+    }
+
+    if (debug)
+      printf("resize to: %d, %d\n", resizewidth, resizeheight);
+    Magick::Geometry resizeGeometry(resizewidth, resizeheight, 0, 0, 0, 0);
+    image.resize(resizeGeometry);
+
+    // limit canvas size to cropGeometry
+    if (debug)
+      printf( "crop to: %d, %d, %d, %d\n", width, height, xoffset, yoffset );
+    Magick::Geometry cropGeometry( width, height, xoffset, yoffset, 0, 0 );
+
+    Magick::Color transparent("white");
+    if (format) {
+      // make background transparent for PNG
+      // JPEG background becomes black if set transparent here
+      transparent.alpha(1.);
+    }
+    image.extent( cropGeometry, transparent );
+  } else if (strcmp (resizeStyle, "aspectfit") == 0 ) {
+    // keep aspect ratio, get the maximum image which fits inside specified size
+    char geometryString[32];
+    sprintf( geometryString, "%dx%d", width, height );
+    if (debug)
+      printf( "resize to: %s\n", geometryString );
+    image.resize(geometryString);
+  } else if (strcmp (resizeStyle, "fill") == 0) {
+    // change aspect ratio and fill specified size
+    char geometryString[32];
+    sprintf( geometryString, "%dx%d!", width, height );
+    if (debug)
+      printf( "resize to: %s\n", geometryString );
+    image.resize(geometryString);
+  } else {
+    return "resizeStyle not supported";
+  }
+
+  if (debug)
+    printf( "resized to: %d, %d\n", (int)image.columns(), (int)image.rows() );
+  return NULL;
+}
+
+void CropImage(Magick::Image &image, double pWidth, double pHeight, double pTop, double pLeft, int debug) {
+  unsigned int width = pWidth*image.columns();
+  if (debug) printf( "width: %d\n", width );
+
+  unsigned int height = pHeight*image.rows();
+  if (debug) printf( "height: %d\n", height );
+
+  unsigned int top = pTop*image.rows();
+  if (debug) printf( "top: %d\n", top );
+
+  unsigned int left = pLeft*image.columns();
+  if (debug) printf( "left: %d\n", left );
+
+  // limit canvas size to cropGeometry
+  if (debug) printf("crop to: %d, %d, %d, %d\n", width, height, left, top);
+  Magick::Geometry cropGeometry( width, height, left, top, 0, 0 );
+
+  image.crop(cropGeometry);
+
+  if (debug) printf( "cropped to: %d, %d\n", (int)image.columns(), (int)image.rows() );
+}
+
+void OrientImage(Magick::Image &image, int debug) {
+  int orientation = atoi(image.attribute("EXIF:Orientation").c_str());
+  if (debug) printf("orientation: %d\n", orientation);
+
+  switch (orientation) {
+    case 1:
+      // no need to do anything
+      break;
+    case 2:
+      image.flip();
+      break;
+    case 3:
+      image.rotate(180);
+      break;
+    case 4:
+      image.flop();
+      break;
+    case 5:
+      image.rotate(90);
+      image.flip();
+      break;
+    case 6:
+      image.rotate(90);
+      break;
+    case 7:
+      image.rotate(-90);
+      image.flip();
+      break;
+    case 8:
+      image.rotate(-90);
+      break;
+    default:
+      if (debug) printf("orientation is missing. skipping");
+  }
+}
@@ -0,0 +1,19 @@
+#ifndef IMAGE_OPS_H
+#define IMAGE_OPS_H
+
+#include <Magick++.h>
+
+// image operations shared by workers, no node dependency.
+
+// resizes to width x height (0 keeps the original) using resizeStyle "aspectfill", "aspectfit" or "fill".
+// format is the output format, if set aspectfill pads with a transparent background.
+// returns NULL or an error message
+const char *ResizeImage(Magick::Image &image, unsigned int width, unsigned int height, const char *resizeStyle, const char *format, int debug);
+
+// crops by 0-1 ratios of the image size
+void CropImage(Magick::Image &image, double pWidth, double pHeight, double pTop, double pLeft, int debug);
+
+// rotates/flips according to EXIF:Orientation
+void OrientImage(Magick::Image &image, int debug);
+
+#endif // IMAGE_OPS_H
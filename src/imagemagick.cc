@@ -3,29 +3,74 @@
 #endif  // BUILDING_NODE_EXTENSION
 
 #include "imagemagick.h"
+#include "admission.h"
+#include "coalesce.h"
+#include "fingerprint.h"
+#include "formats.h"
+#include "helper_pool.h"
+#include "image_handle.h"
+#include "native_memory.h"
+#include "overlay.h"
+#include "tile_pyramid.h"
 #include <list>
+#include <math.h>
 #include <string.h>
 #include <exception>
 
 #define THROW_ERROR_EXCEPTION(x) ThrowException(v8::Exception::Error(String::New(x))); \
   scope.Close(Undefined())
 
+// reads the "analyze" option: true, or an object { componentsX: 1-9, componentsY: 1-9 } for BlurHash.
+// returns 1 if analyze was requested, 0 if not, -1 if components are out of range
+static int AnalyzeOption(Local<Object> obj, unsigned int *componentsX, unsigned int *componentsY) {
+  Local<Value> analyzeValue = obj->Get(NanSymbol("analyze"));
+  *componentsX = BLURHASH_DEFAULT_COMPONENTS_X;
+  *componentsY = BLURHASH_DEFAULT_COMPONENTS_Y;
+  if (analyzeValue->IsUndefined() || !analyzeValue->BooleanValue())
+    return 0;
+
+  if (analyzeValue->IsObject()) {
+    Local<Object> analyzeObj = Local<Object>::Cast(analyzeValue);
+    *componentsX = NanUInt32OptionValue(analyzeObj, NanSymbol("componentsX"), BLURHASH_DEFAULT_COMPONENTS_X);
+    *componentsY = NanUInt32OptionValue(analyzeObj, NanSymbol("componentsY"), BLURHASH_DEFAULT_COMPONENTS_Y);
+    if (*componentsX < 1 || *componentsX > 9 || *componentsY < 1 || *componentsY > 9)
+      return -1;
+  }
+  return 1;
+}
+
+// reads the "inputFormat" option, a decoder hint overriding the magic-byte sniff. "" if not set
+static std::string InputFormatOption(Local<Object> obj) {
+  Local<Value> inputFormatValue = obj->Get(NanSymbol("inputFormat"));
+  if (inputFormatValue->IsUndefined())
+    return "";
+  return *String::Utf8Value(inputFormatValue);
+}
+
 // input
 //   args[ 0 ]: options. required, object with following key,values
 //              {
 //                  srcData:     required. Buffer with binary image data
+//                  inputFormat: optional. decoder to use instead of the magic-byte sniff, ex: "JPEG"
 //                  quality:     optional. 0-100 integer, default 75. JPEG/MIFF/PNG compression level.
 //                  width:       optional. px.
 //                  height:      optional. px.
 //                  resizeStyle: optional. default: "aspectfill". can be "aspectfit", "fill"
 //                  format:      optional. one of http://www.imagemagick.org/script/formats.php ex: "JPEG"
+//                  analyze:     optional. true or { componentsX: 1-9, componentsY: 1-9 }, default 4x3.
+//                               callback gets a 3rd argument { phash: "16 hex chars", blurhash: "..." }
+//                  composite:   optional. name of an overlay registered with registerOverlay(),
+//                               composited after resize
+//                  maxPixels:   optional. fail with err.code "EMAXPIXELS" if the header claims more pixels
+//                  outOfProcess: optional. run in a setWorkerPool() helper process. default true once the pool
+//                               is started, composite jobs always run in process
+//                  coalesce:    optional. default true. join an identical job (same srcData and options) that is
+//                               queued or running instead of starting another one. all callers get the same Buffer
 //                  debug:       optional. 1 or 0
 //              }
 //
 NAN_METHOD(Convert) {
   NanScope();
-  Magick::InitializeMagick(NULL);
-  MagickCore::SetMagickResourceLimit(MagickCore::ThreadResource, 1);
 
   if (args.Length() != 2) {
     THROW_ERROR_EXCEPTION("convert() requires one option argument and one callback argument!");
@@ -43,32 +88,66 @@ NAN_METHOD(Convert) {
   }
 
   Local<Object> obj = Local<Object>::Cast(args[0]);
-  NanCallback *callback = new NanCallback(args[1].As<Function>());
 
   Local<Object> srcData = Local<Object>::Cast(obj->Get(NanSymbol("srcData")));
   if ( srcData->IsUndefined() || ! Buffer::HasInstance(srcData) ) {
     THROW_ERROR_EXCEPTION("convert()'s 1st argument should have \"srcData\" key with a Buffer instance");
     NanReturnUndefined();
   }
-  Magick::Blob srcBlob(Buffer::Data(srcData), Buffer::Length(srcData));
 
   int debug = NanUInt32OptionValue(obj, NanSymbol("debug"), 0);
   if (debug) printf( "debug: on\n" );
 
+  unsigned int componentsX, componentsY;
+  int analyze = AnalyzeOption(obj, &componentsX, &componentsY);
+  if (analyze < 0) {
+    THROW_ERROR_EXCEPTION("\"analyze.componentsX\" and \"analyze.componentsY\" should be between 1 and 9");
+    NanReturnUndefined();
+  }
+  if (debug && analyze) printf( "analyze: %dx%d\n", componentsX, componentsY );
+
+  Local<Value> compositeValue = obj->Get(NanSymbol("composite"));
+  if (!compositeValue->IsUndefined()) {
+    String::Utf8Value compositeName(compositeValue);
+    if (!HasOverlay(*compositeName)) {
+      std::string message = "overlay \"";
+      message            += *compositeName;
+      message            += "\" is not registered";
+      THROW_ERROR_EXCEPTION(message.c_str());
+      NanReturnUndefined();
+    }
+  }
+
+  // overlays live in this process, helpers can't composite them
+  int outOfProcess = NanBooleanOptionValue(obj, NanSymbol("outOfProcess"), HelperPoolStarted() && compositeValue->IsUndefined());
+  if (outOfProcess && (!HelperPoolStarted() || !compositeValue->IsUndefined())) {
+    THROW_ERROR_EXCEPTION("\"outOfProcess\" requires setWorkerPool() and no \"composite\"");
+    NanReturnUndefined();
+  }
+  if (debug && outOfProcess) printf( "outOfProcess: on\n" );
+
+  // nothing is allocated before this point, the checks above can throw without leaking
+  NanCallback *callback = new NanCallback(args[1].As<Function>());
+  Magick::Blob srcBlob(Buffer::Data(srcData), Buffer::Length(srcData));
+
+  std::string inputFormat = InputFormatOption(obj);
+  size_t maxPixels = NanUInt32OptionValue(obj, NanSymbol("maxPixels"), 0);
+
   unsigned int width = obj->Get(NanSymbol("width"))->Uint32Value();
   if (debug) printf( "width: %d\n", width );
 
   unsigned int height = obj->Get(NanSymbol("height"))->Uint32Value();
   if (debug) printf( "height: %d\n", height );
 
+  // owned by the worker, which delete[]s it
   Local<Value> resizeStyleValue = obj->Get(NanSymbol("resizeStyle"));
-  const char* resizeStyle = NULL;
-  String::AsciiValue resizeStyleAsciiValue(resizeStyleValue->ToString());
+  char *resizeStyle;
   if (!resizeStyleValue->IsUndefined()) {
-    resizeStyle = static_cast<const char *>(malloc(resizeStyleAsciiValue.length() + 1));
-    strcpy((char *) resizeStyle, (char *) *resizeStyleAsciiValue);
+    size_t resizeStyle_cnt;
+    resizeStyle = NanCString(resizeStyleValue, &resizeStyle_cnt);
   } else {
-    resizeStyle = "aspectfill";
+    resizeStyle = new char[sizeof("aspectfill")];
+    strcpy(resizeStyle, "aspectfill");
   }
   if (debug) printf("resizeStyle: %s\n", resizeStyle);
 
@@ -80,7 +159,38 @@ NAN_METHOD(Convert) {
   if (!fmt->IsUndefined())
     format = NanCString(obj->Get(NanSymbol("format")), &format_cnt);
 
-  NanAsyncQueueWorker(new ConvertWorker(callback, debug, srcBlob, width, height, quality, format, resizeStyle));
+  char *composite = NULL;
+  if (!compositeValue->IsUndefined()) {
+    size_t composite_cnt;
+    composite = NanCString(compositeValue, &composite_cnt);
+    if (debug) printf( "composite: %s\n", composite );
+  }
+
+  std::string coalesceKey;
+  if (NanBooleanOptionValue(obj, NanSymbol("coalesce"), true)) {
+    coalesceKey = CoalesceKey(Buffer::Data(srcData), Buffer::Length(srcData), inputFormat, maxPixels, width, height, quality, format, resizeStyle, analyze, componentsX, componentsY, composite);
+    ConvertWorker *inFlight = FindInFlight(coalesceKey, Buffer::Data(srcData), Buffer::Length(srcData));
+    if (inFlight) {
+      if (debug) printf( "coalesced with an identical job\n" );
+      inFlight->AddWaiter(callback);
+      delete[] resizeStyle;
+      if (format)
+        delete[] format;
+      if (composite)
+        delete[] composite;
+      NanReturnUndefined();
+    }
+  }
+
+  ConvertWorker *worker = new ConvertWorker(callback, debug, srcBlob, width, height, quality, format, resizeStyle, analyze, componentsX, componentsY, composite, outOfProcess);
+  worker->srcFormat = inputFormat;
+  if (!coalesceKey.empty())
+    worker->Coalesce(coalesceKey);
+  // helpers parse the header themselves, this process only sniffs the magic bytes
+  if (outOfProcess)
+    RouteAndAdmitWorker(worker, maxPixels, debug);
+  else
+    PingAndAdmitWorker(worker, NULL, maxPixels, debug);
   NanReturnUndefined();
 }
 
@@ -99,8 +209,6 @@ NAN_METHOD(Convert) {
 //
 NAN_METHOD(ConvertFile) {
   NanScope();
-  Magick::InitializeMagick(NULL);
-  MagickCore::SetMagickResourceLimit(MagickCore::ThreadResource, 1);
 
   if (args.Length() != 2) {
     THROW_ERROR_EXCEPTION("convert() requires one option argument and one callback argument!");
@@ -176,19 +284,19 @@ NAN_METHOD(ConvertFile) {
 //   args[ 0 ]: options. required, object with following key,values
 //              {
 //                  srcData:     required. Buffer with binary image data
+//                  inputFormat: optional. decoder to use instead of the magic-byte sniff, ex: "JPEG"
 //                  left:        required. 0-1 defines left corner crop position, default 0
 //                  top:         required. 0-1 defines top corner crop position, default0
 //                  quality:     optional. 0-100 integer, default 75. JPEG/MIFF/PNG compression level.
 //                  width:       optional. 0-1 defines crop width, default is image.width
 //                  height:      optional. 0-1 defines crop height, default is image.height
 //                  format:      optional. one of http://www.imagemagick.org/script/formats.php ex: "JPEG"
+//                  maxPixels:   optional. fail with err.code "EMAXPIXELS" if the header claims more pixels
 //                  debug:       optional. 1 or 0
 //              }
 // TODO: convert into crop function
 NAN_METHOD(Crop) {
   NanScope();
-  Magick::InitializeMagick(NULL);
-  MagickCore::SetMagickResourceLimit(MagickCore::ThreadResource, 1);
 
   if (args.Length() != 2) {
     THROW_ERROR_EXCEPTION("crop() requires one option argument and one callback argument!");
@@ -248,6 +356,7 @@ NAN_METHOD(Crop) {
     NanReturnUndefined();
   }
 
+
   unsigned int quality = obj->Get(NanSymbol("quality"))->Uint32Value();
 
   Local<Object> fmt = Local<Object>::Cast(obj->Get(NanSymbol("format")));
@@ -256,7 +365,9 @@ NAN_METHOD(Crop) {
   if (!fmt->IsUndefined())
     format = NanCString(obj->Get(NanSymbol("format")), &format_cnt);
 
-  NanAsyncQueueWorker(new CropWorker(callback, debug, srcBlob, pWidth->NumberValue(), pHeight->NumberValue(), pTop->NumberValue(), pLeft->NumberValue(), quality, format));
+  CropWorker *worker = new CropWorker(callback, debug, srcBlob, pWidth->NumberValue(), pHeight->NumberValue(), pTop->NumberValue(), pLeft->NumberValue(), quality, format);
+  worker->srcFormat = InputFormatOption(obj);
+  PingAndAdmitWorker(worker, NULL, NanUInt32OptionValue(obj, NanSymbol("maxPixels"), 0), debug);
   NanReturnUndefined();
 }
 
@@ -264,66 +375,55 @@ NAN_METHOD(Crop) {
 //   args[ 0 ]: options. required, object with following key,values
 //              {
 //                  srcData:        required. Buffer with binary image data
+//                  inputFormat:    optional. decoder to use instead of the magic-byte sniff, ex: "JPEG"
+//                  analyze:        optional. true or { componentsX: 1-9, componentsY: 1-9 }, default 4x3.
+//                                  adds "phash" and "blurhash" to the result
+//                  maxPixels:      optional. fail with err.code "EMAXPIXELS" if the header claims more pixels
 //                  debug:          optional. 1 or 0
 //              }
 NAN_METHOD(Identify) {
   NanScope();
-  Magick::InitializeMagick(NULL);
-  MagickCore::SetMagickResourceLimit(MagickCore::ThreadResource, 1);
 
   if (args.Length() != 2) {
-    THROW_ERROR_EXCEPTION("normalize() requires one option argument and one callback argument!");
+    THROW_ERROR_EXCEPTION("identify() requires one option argument and one callback argument!");
     NanReturnUndefined();
   }
 
   if (!args[0]->IsObject()) {
-    THROW_ERROR_EXCEPTION("normalize()'s 1st argument should be an object");
+    THROW_ERROR_EXCEPTION("identify()'s 1st argument should be an object");
     NanReturnUndefined();
   }
 
   if (!args[1]->IsFunction()) {
-    THROW_ERROR_EXCEPTION("normalize()'s 2nd argument should be a callback");
+    THROW_ERROR_EXCEPTION("identify()'s 2nd argument should be a callback");
     NanReturnUndefined();
   }
 
   Local<Object> obj = Local<Object>::Cast(args[0]);
-  NanCallback *callback = new NanCallback(args[1].As<Function>());
 
   Local<Object> srcData = Local<Object>::Cast( obj->Get( NanSymbol("srcData") ) );
   if ( srcData->IsUndefined() || ! Buffer::HasInstance(srcData) ) {
-    THROW_ERROR_EXCEPTION("normalize()'s 1st argument should have \"srcData\" key with a Buffer instance");
+    THROW_ERROR_EXCEPTION("identify()'s 1st argument should have \"srcData\" key with a Buffer instance");
     NanReturnUndefined();
   }
 
   int debug = NanUInt32OptionValue(obj, NanSymbol("debug"), 0);
   if (debug) printf( "debug: on\n" );
 
-  Magick::Blob srcBlob( Buffer::Data(srcData), Buffer::Length(srcData) );
-
-  Magick::Image image;
-  try {
-    image.read( srcBlob );
-  }
-  catch (std::exception& err) {
-    std::string message = "image.read failed with error: ";
-    message            += err.what();
-    return THROW_ERROR_EXCEPTION(message.c_str());
-  }
-  catch (...) {
-    return THROW_ERROR_EXCEPTION("unhandled error");
+  unsigned int componentsX, componentsY;
+  int analyze = AnalyzeOption(obj, &componentsX, &componentsY);
+  if (analyze < 0) {
+    THROW_ERROR_EXCEPTION("\"analyze.componentsX\" and \"analyze.componentsY\" should be between 1 and 9");
+    NanReturnUndefined();
   }
 
-  if (debug) printf("original width,height: %d, %d\n", (int) image.columns(), (int) image.rows());
-
-  Local<Object> out = Object::New();
+  NanCallback *callback = new NanCallback(args[1].As<Function>());
 
-  out->Set(NanSymbol("width"), Integer::New(image.columns()));
-  out->Set(NanSymbol("height"), Integer::New(image.rows()));
-  out->Set(NanSymbol("depth"), Integer::New(image.depth()));
-  out->Set(NanSymbol("format"), String::New(image.magick().c_str()));
+  Magick::Blob srcBlob( Buffer::Data(srcData), Buffer::Length(srcData) );
 
-  Local<Value> argv[] = {Local<Value>::New(Undefined()), out};
-  callback->Call(2, argv);
+  IdentifyWorker *worker = new IdentifyWorker(callback, debug, srcBlob, analyze, componentsX, componentsY);
+  worker->srcFormat = InputFormatOption(obj);
+  PingAndAdmitWorker(worker, NULL, NanUInt32OptionValue(obj, NanSymbol("maxPixels"), 0), debug);
   NanReturnUndefined();
 }
 
@@ -331,12 +431,12 @@ NAN_METHOD(Identify) {
 //   args[ 0 ]: options. required, object with following key,values
 //              {
 //                  srcData:        required. Buffer with binary image data
+//                  inputFormat:    optional. decoder to use instead of the magic-byte sniff, ex: "JPEG"
+//                  maxPixels:      optional. fail with err.code "EMAXPIXELS" if the header claims more pixels
 //                  debug:          optional. 1 or 0
 //              }
 NAN_METHOD(Normalize) {
   NanScope();
-  Magick::InitializeMagick(NULL);
-  MagickCore::SetMagickResourceLimit(MagickCore::ThreadResource, 1);
 
   if (args.Length() != 2) {
     THROW_ERROR_EXCEPTION("normalize() requires one option argument and one callback argument!");
@@ -367,16 +467,473 @@ NAN_METHOD(Normalize) {
 
   Magick::Blob srcBlob(Buffer::Data(srcData), Buffer::Length(srcData));
 
-  NanAsyncQueueWorker(new NormalizeWorker(callback, debug, srcBlob));
+
+  NormalizeWorker *worker = new NormalizeWorker(callback, debug, srcBlob);
+  worker->srcFormat = InputFormatOption(obj);
+  PingAndAdmitWorker(worker, NULL, NanUInt32OptionValue(obj, NanSymbol("maxPixels"), 0), debug);
   NanReturnUndefined();
 }
 
+// input
+//   args[ 0 ]: options. required, object with following key,values
+//              {
+//                  srcData:        required. Buffer with binary image data
+//                  inputFormat:    optional. decoder to use instead of the magic-byte sniff, ex: "JPEG"
+//                  colors:         optional. number of colors to extract, default 5
+//                  maxPixels:      optional. fail with err.code "EMAXPIXELS" if the header claims more pixels
+//                  debug:          optional. 1 or 0
+//              }
+NAN_METHOD(QuantizeColors) {
+  NanScope();
+
+  if (args.Length() != 2) {
+    THROW_ERROR_EXCEPTION("quantizeColors() requires one option argument and one callback argument!");
+    NanReturnUndefined();
+  }
+
+  if (!args[0]->IsObject()) {
+    THROW_ERROR_EXCEPTION("quantizeColors()'s 1st argument should be an object");
+    NanReturnUndefined();
+  }
+
+  if (!args[1]->IsFunction()) {
+    THROW_ERROR_EXCEPTION("quantizeColors()'s 2nd argument should be a callback");
+    NanReturnUndefined();
+  }
+
+  Local<Object> obj = Local<Object>::Cast(args[0]);
+
+  Local<Object> srcData = Local<Object>::Cast( obj->Get( NanSymbol("srcData") ) );
+  if ( srcData->IsUndefined() || ! Buffer::HasInstance(srcData) ) {
+    THROW_ERROR_EXCEPTION("quantizeColors()'s 1st argument should have \"srcData\" key with a Buffer instance");
+    NanReturnUndefined();
+  }
+
+  unsigned int colors = 5;
+  Local<Value> colorsValue = obj->Get(NanSymbol("colors"));
+  if (!colorsValue->IsUndefined()) {
+    double n = colorsValue->NumberValue();
+    if (!colorsValue->IsNumber() || n != floor(n) || n < 1 || n > 256) {
+      THROW_ERROR_EXCEPTION("\"colors\" should be an integer between 1 and 256");
+      NanReturnUndefined();
+    }
+    colors = (unsigned int) n;
+  }
+
+  int debug = NanUInt32OptionValue(obj, NanSymbol("debug"), 0);
+  if (debug) printf( "debug: on\n" );
+  if (debug) printf( "colors: %d\n", colors );
+
+  NanCallback *callback = new NanCallback(args[1].As<Function>());
+
+  Magick::Blob srcBlob(Buffer::Data(srcData), Buffer::Length(srcData));
+
+
+  QuantizeColorsWorker *worker = new QuantizeColorsWorker(callback, debug, srcBlob, colors);
+  worker->srcFormat = InputFormatOption(obj);
+  PingAndAdmitWorker(worker, NULL, NanUInt32OptionValue(obj, NanSymbol("maxPixels"), 0), debug);
+  NanReturnUndefined();
+}
+
+// input
+//   args[ 0 ]: options. required, object with following key,values
+//              {
+//                  maxPixels:      optional. jobs claiming more pixels fail fast with err.code "EMAXPIXELS". 0: unlimited
+//                  maxMemory:      optional. bytes of estimated decoded images processed at once,
+//                                  other jobs wait for their turn. 0: unlimited
+//              }
+// keys left undefined keep their current value
+NAN_METHOD(SetLimits) {
+  NanScope();
+
+  if (args.Length() != 1 || !args[0]->IsObject()) {
+    THROW_ERROR_EXCEPTION("setLimits() requires one option argument!");
+    NanReturnUndefined();
+  }
+
+  Local<Object> obj = Local<Object>::Cast(args[0]);
+  size_t maxPixels, maxMemory;
+  GetAdmissionLimits(&maxPixels, &maxMemory);
+
+  Local<Value> maxPixelsValue = obj->Get(NanSymbol("maxPixels"));
+  if (!maxPixelsValue->IsUndefined()) {
+    double value = maxPixelsValue->NumberValue();
+    maxPixels = value > 0 ? (size_t) value : 0;
+  }
+  Local<Value> maxMemoryValue = obj->Get(NanSymbol("maxMemory"));
+  if (!maxMemoryValue->IsUndefined()) {
+    double value = maxMemoryValue->NumberValue();
+    maxMemory = value > 0 ? (size_t) value : 0;
+  }
+  SetAdmissionLimits(maxPixels, maxMemory);
+  NanReturnUndefined();
+}
+
+// input
+//   args[ 0 ]: Array of format names, ex: [ "JPEG", "PNG", "GIF", "WEBP" ]. empty allows every format
+// restricts inputs of every function to these formats. other inputs fail with err.code "EFORMAT"
+// before any decode work, and their coders are never loaded
+NAN_METHOD(SetAllowedFormats) {
+  NanScope();
+
+  if (args.Length() != 1 || !args[0]->IsArray()) {
+    THROW_ERROR_EXCEPTION("setAllowedFormats() requires one Array argument!");
+    NanReturnUndefined();
+  }
+
+  Local<Array> formatsArray = Local<Array>::Cast(args[0]);
+  std::vector<std::string> formats;
+  for (unsigned int i = 0; i < formatsArray->Length(); i++)
+    formats.push_back(*String::Utf8Value(formatsArray->Get(i)));
+
+  std::string error;
+  if (!SetAllowedFormats(formats, &error)) {
+    THROW_ERROR_EXCEPTION(error.c_str());
+    NanReturnUndefined();
+  }
+  NanReturnUndefined();
+}
+
+// input
+//   args[ 0 ]: options. required, object with following key,values
+//              {
+//                  size:           optional. number of helper processes, default 2
+//                  memoryLimit:    optional. address space limit of each helper in bytes. 0: unlimited
+//                  timeout:        optional. ms a helper may spend on a job before it's killed and respawned,
+//                                  default 30000. 0: unlimited
+//                  helperPath:     optional. default: imagemagick_helper next to this addon
+//              }
+// starts helper processes convert() hands its jobs to. a crashing helper fails only its job
+// and is replaced. the pool can be started once, before the first convert()
+NAN_METHOD(SetWorkerPool) {
+  NanScope();
+
+  if (args.Length() != 1 || !args[0]->IsObject()) {
+    THROW_ERROR_EXCEPTION("setWorkerPool() requires one option argument!");
+    NanReturnUndefined();
+  }
+
+  Local<Object> obj = Local<Object>::Cast(args[0]);
+  unsigned int size = NanUInt32OptionValue(obj, NanSymbol("size"), 2);
+  if (size < 1) {
+    THROW_ERROR_EXCEPTION("setWorkerPool()'s \"size\" should be at least 1");
+    NanReturnUndefined();
+  }
+  double memoryLimit = obj->Get(NanSymbol("memoryLimit"))->NumberValue();
+  unsigned int timeout = NanUInt32OptionValue(obj, NanSymbol("timeout"), 30000);
+
+  Local<Value> helperPathValue = obj->Get(NanSymbol("helperPath"));
+  char *helperPath = NULL;
+  if (!helperPathValue->IsUndefined()) {
+    size_t helperPath_cnt;
+    helperPath = NanCString(helperPathValue, &helperPath_cnt);
+  }
+
+  std::string error;
+  bool started = StartHelperPool(size, memoryLimit > 0 ? (size_t) memoryLimit : 0, timeout, helperPath, &error);
+  if (helperPath)
+    delete[] helperPath;
+  if (!started) {
+    error = "setWorkerPool() failed: " + error;
+    THROW_ERROR_EXCEPTION(error.c_str());
+    NanReturnUndefined();
+  }
+  NanReturnUndefined();
+}
+
+// input
+//   args[ 0 ]: Buffer with binary image data
+//   args[ 1 ]: options. optional, object with following key,values
+//              {
+//                  inputFormat: optional. decoder to use instead of the magic-byte sniff, ex: "PNG"
+//                  maxPixels:   optional. fail with err.code "EMAXPIXELS" if the image header claims more pixels
+//                  debug:       optional. 1 or 0
+//              }
+//   args[ 2 ]: callback(err, handle). handle keeps the decoded image in native memory,
+//              see ImageHandle for the operations it supports
+NAN_METHOD(Load) {
+  NanScope();
+
+  if (args.Length() != 2 && args.Length() != 3) {
+    THROW_ERROR_EXCEPTION("load() requires one Buffer argument, an optional option argument and one callback argument!");
+    NanReturnUndefined();
+  }
+
+  if (!Buffer::HasInstance(args[0])) {
+    THROW_ERROR_EXCEPTION("load()'s 1st argument should be a Buffer instance");
+    NanReturnUndefined();
+  }
+
+  if (args.Length() == 3 && !args[1]->IsObject()) {
+    THROW_ERROR_EXCEPTION("load()'s 2nd argument should be an object");
+    NanReturnUndefined();
+  }
+
+  Local<Value> callbackValue = args[args.Length() - 1];
+  if (!callbackValue->IsFunction()) {
+    THROW_ERROR_EXCEPTION("load()'s last argument should be a callback");
+    NanReturnUndefined();
+  }
+
+  Local<Object> obj = args.Length() == 3 ? Local<Object>::Cast(args[1]) : Object::New();
+
+  int debug = NanUInt32OptionValue(obj, NanSymbol("debug"), 0);
+  if (debug) printf( "debug: on\n" );
+
+  Local<Object> srcData = args[0]->ToObject();
+  NanCallback *callback = new NanCallback(callbackValue.As<Function>());
+
+  Magick::Blob srcBlob(Buffer::Data(srcData), Buffer::Length(srcData));
+
+  LoadWorker *worker = new LoadWorker(callback, debug, srcBlob);
+  worker->srcFormat = InputFormatOption(obj);
+  PingAndAdmitWorker(worker, NULL, NanUInt32OptionValue(obj, NanSymbol("maxPixels"), 0), debug);
+  NanReturnUndefined();
+}
+
+// input
+//   args[ 0 ]: name of the overlay, referenced by convert()'s "composite" option
+//   args[ 1 ]: Buffer with binary image data, decoded on the threadpool
+//   args[ 2 ]: options. optional, object with following key,values
+//              {
+//                  gravity:      optional. default "SouthEast". one of NorthWest, North, NorthEast,
+//                                West, Center, East, SouthWest, South, SouthEast
+//                  scale:        optional. overlay width relative to the output width, default 0 keeps its size
+//                  outputWidths: optional. Array of output widths to pre-scale the overlay for.
+//                                other widths scale the overlay in every job
+//                  inputFormat:  optional. decoder to use instead of the magic-byte sniff, ex: "PNG"
+//                  maxPixels:    optional. fail with err.code "EMAXPIXELS" if the image header claims more pixels
+//                  debug:        optional. 1 or 0
+//              }
+//   args[ 3 ]: callback, called once the overlay is registered or failed
+NAN_METHOD(RegisterOverlay) {
+  NanScope();
+
+  if (args.Length() < 3 || !args[0]->IsString()) {
+    THROW_ERROR_EXCEPTION("registerOverlay() requires a name, a Buffer and a callback argument!");
+    NanReturnUndefined();
+  }
+
+  if (!Buffer::HasInstance(args[1])) {
+    THROW_ERROR_EXCEPTION("registerOverlay()'s 2nd argument should be a Buffer instance");
+    NanReturnUndefined();
+  }
+
+  Local<Value> callbackValue = args[args.Length() - 1];
+  if (!callbackValue->IsFunction()) {
+    THROW_ERROR_EXCEPTION("registerOverlay()'s last argument should be a callback");
+    NanReturnUndefined();
+  }
+
+  String::Utf8Value name(args[0]);
+  std::string inputFormat;
+  std::string gravity = "SouthEast";
+  double scale = 0;
+  std::vector<unsigned int> outputWidths;
+  size_t maxPixels = 0;
+  int debug = 0;
+
+  if (args.Length() > 3 && args[2]->IsObject()) {
+    Local<Object> obj = Local<Object>::Cast(args[2]);
+
+    Local<Value> gravityValue = obj->Get(NanSymbol("gravity"));
+    if (!gravityValue->IsUndefined())
+      gravity = *String::Utf8Value(gravityValue);
+    if (!IsValidGravity(gravity.c_str())) {
+      THROW_ERROR_EXCEPTION("\"gravity\" should be one of NorthWest, North, NorthEast, West, Center, East, SouthWest, South, SouthEast");
+      NanReturnUndefined();
+    }
+
+    Local<Value> scaleValue = obj->Get(NanSymbol("scale"));
+    if (!scaleValue->IsUndefined())
+      scale = scaleValue->NumberValue();
+    if (!(scale >= 0 && scale <= 1)) {
+      THROW_ERROR_EXCEPTION("\"scale\" should be Number with the value between 0 and 1");
+      NanReturnUndefined();
+    }
+
+    inputFormat = InputFormatOption(obj);
+    maxPixels   = NanUInt32OptionValue(obj, NanSymbol("maxPixels"), 0);
+    debug       = NanUInt32OptionValue(obj, NanSymbol("debug"), 0);
+
+    Local<Value> widthsValue = obj->Get(NanSymbol("outputWidths"));
+    if (widthsValue->IsArray()) {
+      Local<Array> widths = Local<Array>::Cast(widthsValue);
+      for (unsigned int i = 0; i < widths->Length(); i++)
+        outputWidths.push_back(widths->Get(i)->Uint32Value());
+    }
+  }
+  if (debug) printf( "debug: on\n" );
+
+  NanCallback *callback = new NanCallback(callbackValue.As<Function>());
+
+  Local<Object> srcData = args[1]->ToObject();
+  Magick::Blob srcBlob(Buffer::Data(srcData), Buffer::Length(srcData));
+
+  RegisterOverlayWorker *worker = new RegisterOverlayWorker(callback, debug, srcBlob, *name, gravity, scale, outputWidths);
+  worker->srcFormat = inputFormat;
+  PingAndAdmitWorker(worker, NULL, maxPixels, debug);
+  NanReturnUndefined();
+}
+
+// input
+//   args[ 0 ]: name of the overlay to free. jobs already compositing it are not affected
+NAN_METHOD(UnregisterOverlay) {
+  NanScope();
+
+  if (args.Length() != 1 || !args[0]->IsString()) {
+    THROW_ERROR_EXCEPTION("unregisterOverlay() requires a name argument!");
+    NanReturnUndefined();
+  }
+
+  String::Utf8Value name(args[0]);
+  AdjustNativeMemory(NATIVE_MEMORY_OVERLAYS, -(ssize_t)RemoveOverlay(*name));
+  NanReturnUndefined();
+}
+
+// input
+//   args[ 0 ]: options. required, object with following key,values
+//              {
+//                  srcPath:     required, or srcData. Source image file
+//                  srcData:     required, or srcPath. Buffer with binary image data
+//                  inputFormat: optional. decoder to use instead of the magic-byte sniff, ex: "JPEG"
+//                  outDir:      required, or onTile. tiles are written to outDir/<level>/<column>_<row>.<ext>,
+//                               level directories are created, outDir must exist
+//                  onTile:      required, or outDir. function({ level, column, row, data: Buffer }) called per tile
+//                  tileSize:    optional. px, default 256
+//                  overlap:     optional. px, default 1
+//                  format:      optional. tile format, default "JPEG"
+//                  quality:     optional. 0-100 integer, default 75. JPEG/MIFF/PNG compression level.
+//                  threads:     optional. threads encoding tiles, default 4, at most the CPU count
+//                  maxPixels:   optional. fail with err.code "EMAXPIXELS" if the header claims more pixels
+//                  debug:       optional. 1 or 0
+//              }
+//   args[ 1 ]: callback(err, { width, height, levels, tileSize, overlap, format, tiles })
+NAN_METHOD(TilePyramid) {
+  NanScope();
+
+  if (args.Length() != 2) {
+    THROW_ERROR_EXCEPTION("tilePyramid() requires one option argument and one callback argument!");
+    NanReturnUndefined();
+  }
+
+  if (!args[0]->IsObject()) {
+    THROW_ERROR_EXCEPTION("tilePyramid()'s 1st argument should be an object");
+    NanReturnUndefined();
+  }
+
+  if (!args[1]->IsFunction()) {
+    THROW_ERROR_EXCEPTION("tilePyramid()'s 2nd argument should be a callback");
+    NanReturnUndefined();
+  }
+
+  Local<Object> obj = Local<Object>::Cast(args[0]);
+
+  Local<Value> srcPathValue = obj->Get(NanSymbol("srcPath"));
+  Local<Value> srcData      = obj->Get(NanSymbol("srcData"));
+  if (srcPathValue->IsUndefined() == srcData->IsUndefined() ||
+      (!srcData->IsUndefined() && !Buffer::HasInstance(srcData))) {
+    THROW_ERROR_EXCEPTION("tilePyramid()'s 1st argument should have either \"srcPath\" key with a String or \"srcData\" key with a Buffer instance");
+    NanReturnUndefined();
+  }
+
+  Local<Value> outDirValue = obj->Get(NanSymbol("outDir"));
+  Local<Value> onTileValue = obj->Get(NanSymbol("onTile"));
+  if (outDirValue->IsUndefined() == onTileValue->IsUndefined() ||
+      (!onTileValue->IsUndefined() && !onTileValue->IsFunction())) {
+    THROW_ERROR_EXCEPTION("tilePyramid()'s 1st argument should have either \"outDir\" key with a String or \"onTile\" key with a function");
+    NanReturnUndefined();
+  }
+
+  unsigned int tileSize = NanUInt32OptionValue(obj, NanSymbol("tileSize"), 256);
+  unsigned int overlap  = NanUInt32OptionValue(obj, NanSymbol("overlap"), 1);
+  if (!tileSize || overlap >= tileSize) {
+    THROW_ERROR_EXCEPTION("\"tileSize\" should be positive and larger than \"overlap\"");
+    NanReturnUndefined();
+  }
+
+  unsigned int threads = NanUInt32OptionValue(obj, NanSymbol("threads"), 4);
+  if (!threads) {
+    THROW_ERROR_EXCEPTION("\"threads\" should be positive");
+    NanReturnUndefined();
+  }
+
+  int debug = NanUInt32OptionValue(obj, NanSymbol("debug"), 0);
+  if (debug) printf( "debug: on\n" );
+
+  // more threads than CPUs only add stacks and contention
+  uv_cpu_info_t *cpus;
+  int cpuCount = 0;
+  uv_cpu_info(&cpus, &cpuCount);
+  if (cpuCount > 0)
+    uv_free_cpu_info(cpus, cpuCount);
+  unsigned int maxThreads = cpuCount > 0 ? cpuCount : 4;
+  if (threads > maxThreads)
+    threads = maxThreads;
+  if (debug) printf( "threads: %d\n", threads );
+
+  NanCallback *callback = new NanCallback(args[1].As<Function>());
+  char *srcPath = NULL;
+  Magick::Blob srcBlob;
+  size_t count;
+  if (!srcPathValue->IsUndefined())
+    srcPath = NanCString(srcPathValue, &count);
+  else
+    srcBlob = Magick::Blob(Buffer::Data(srcData), Buffer::Length(srcData));
+
+  char *outDir = NULL;
+  NanCallback *onTile = NULL;
+  if (!outDirValue->IsUndefined())
+    outDir = NanCString(outDirValue, &count);
+  else
+    onTile = new NanCallback(onTileValue.As<Function>());
+
+  unsigned int quality = obj->Get(NanSymbol("quality"))->Uint32Value();
+
+  char *format;
+  Local<Value> formatValue = obj->Get(NanSymbol("format"));
+  if (!formatValue->IsUndefined()) {
+    format = NanCString(formatValue, &count);
+  } else {
+    format = new char[5];
+    strcpy(format, "JPEG");
+  }
+
+  TilePyramidWorker *worker = new TilePyramidWorker(callback, onTile, debug, srcBlob, srcPath, outDir, tileSize, overlap, format, quality, threads);
+  worker->srcFormat = InputFormatOption(obj);
+  PingAndAdmitWorker(worker, srcPath, NanUInt32OptionValue(obj, NanSymbol("maxPixels"), 0), debug);
+  NanReturnUndefined();
+}
+
+// returns native memory held by the addon, in bytes
+//   { input: srcData copies, pixels: estimated pixel caches of running jobs, output: Buffers not yet collected,
+//     handles: decoded images held by ImageHandles, overlays: registered overlays, total }
+NAN_METHOD(MemoryUsage) {
+  NanScope();
+  NanReturnValue(NativeMemoryUsage());
+}
+
 void init(Handle<Object> target) {
+  // once, not per call. coders are registered as ImageMagick first needs them
+  Magick::InitializeMagick(NULL);
+  MagickCore::SetMagickResourceLimit(MagickCore::ThreadResource, 1);
+  ImageHandle::Init();
+  InitOverlayRegistry();
+
   target->Set(NanSymbol("convert"), FunctionTemplate::New(Convert)->GetFunction());
   target->Set(NanSymbol("convertFile"), FunctionTemplate::New(ConvertFile)->GetFunction());
   target->Set(NanSymbol("crop"), FunctionTemplate::New(Crop)->GetFunction());
   target->Set(NanSymbol("identify"), FunctionTemplate::New(Identify)->GetFunction());
   target->Set(NanSymbol("normalize"), FunctionTemplate::New(Normalize)->GetFunction());
+  target->Set(NanSymbol("quantizeColors"), FunctionTemplate::New(QuantizeColors)->GetFunction());
+  target->Set(NanSymbol("setLimits"), FunctionTemplate::New(SetLimits)->GetFunction());
+  target->Set(NanSymbol("setAllowedFormats"), FunctionTemplate::New(SetAllowedFormats)->GetFunction());
+  target->Set(NanSymbol("setWorkerPool"), FunctionTemplate::New(SetWorkerPool)->GetFunction());
+  target->Set(NanSymbol("memoryUsage"), FunctionTemplate::New(MemoryUsage)->GetFunction());
+  target->Set(NanSymbol("load"), FunctionTemplate::New(Load)->GetFunction());
+  target->Set(NanSymbol("registerOverlay"), FunctionTemplate::New(RegisterOverlay)->GetFunction());
+  target->Set(NanSymbol("unregisterOverlay"), FunctionTemplate::New(UnregisterOverlay)->GetFunction());
+  target->Set(NanSymbol("tilePyramid"), FunctionTemplate::New(TilePyramid)->GetFunction());
 }
 
 // There is no semi-colon after NODE_MODULE as it's not a function (see node.h).
@@ -0,0 +1,42 @@
+#ifndef BUILDING_NODE_EXTENSION
+#define BUILDING_NODE_EXTENSION
+#endif  // BUILDING_NODE_EXTENSION
+
+#include "native_memory.h"
+#include <node_buffer.h>
+
+using namespace node;
+
+static const char *categoryNames[ NATIVE_MEMORY_CATEGORIES ] = { "input", "pixels", "output", "handles", "overlays" };
+static size_t usage[ NATIVE_MEMORY_CATEGORIES ];
+
+void AdjustNativeMemory(NativeMemoryCategory category, ssize_t bytes) {
+  if (!bytes)
+    return;
+  usage[ category ] += bytes;
+  V8::AdjustAmountOfExternalAllocatedMemory(bytes);
+}
+
+static void FreeBlob(char *data, void *hint) {
+  Magick::Blob *blob = static_cast<Magick::Blob*>(hint);
+  AdjustNativeMemory(NATIVE_MEMORY_OUTPUT, -(ssize_t)blob->length());
+  delete blob;
+}
+
+Local<Object> NativeMemoryBuffer(const Magick::Blob &blob) {
+  // Blobs are reference counted, the copy keeps the data alive after the worker is gone
+  Magick::Blob *shared = new Magick::Blob(blob);
+  AdjustNativeMemory(NATIVE_MEMORY_OUTPUT, shared->length());
+  return NanNewBufferHandle((char*)shared->data(), shared->length(), FreeBlob, shared);
+}
+
+Local<Object> NativeMemoryUsage() {
+  Local<Object> out = Object::New();
+  size_t total = 0;
+  for (int i = 0; i < NATIVE_MEMORY_CATEGORIES; i++) {
+    out->Set(NanSymbol(categoryNames[i]), Number::New(usage[i]));
+    total += usage[i];
+  }
+  out->Set(NanSymbol("total"), Number::New(total));
+  return out;
+}
@@ -0,0 +1,29 @@
+#ifndef NATIVE_MEMORY_H
+#define NATIVE_MEMORY_H
+
+#include <Magick++.h>
+#include <node.h>
+#include "nan.h"
+using namespace v8;
+
+// native allocations tied to JS objects, reported to V8 so GC pressure reflects them.
+enum NativeMemoryCategory {
+  NATIVE_MEMORY_INPUT,    // srcData copies held by queued and running workers
+  NATIVE_MEMORY_PIXELS,   // estimated pixel caches of admitted jobs
+  NATIVE_MEMORY_OUTPUT,   // output Blobs shared with Buffers passed to callbacks
+  NATIVE_MEMORY_HANDLES,  // decoded images held by ImageHandles
+  NATIVE_MEMORY_OVERLAYS, // registered overlays and their pre-scaled copies
+  NATIVE_MEMORY_CATEGORIES
+};
+
+// main thread only
+void AdjustNativeMemory(NativeMemoryCategory category, ssize_t bytes);
+
+// returns a Buffer sharing blob's data without copying.
+// blob and its accounting are released when the Buffer is garbage collected
+Local<Object> NativeMemoryBuffer(const Magick::Blob &blob);
+
+// { input, pixels, output, handles, overlays, total } in bytes
+Local<Object> NativeMemoryUsage();
+
+#endif // NATIVE_MEMORY_H
@@ -0,0 +1,174 @@
+#include "overlay.h"
+#include "formats.h"
+#include <map>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <uv.h>
+
+struct Overlay {
+  Magick::Image image;
+  Magick::GravityType gravity;
+  double scale;
+  // output width => overlay scaled for it
+  std::map<unsigned int, Magick::Image> scaled;
+  size_t bytes;
+};
+
+static uv_mutex_t registryMutex;
+static std::map<std::string, Overlay*> registry;
+
+static const struct {
+  const char *name;
+  Magick::GravityType gravity;
+} gravities[] = {
+  { "NorthWest", Magick::NorthWestGravity },
+  { "North",     Magick::NorthGravity },
+  { "NorthEast", Magick::NorthEastGravity },
+  { "West",      Magick::WestGravity },
+  { "Center",    Magick::CenterGravity },
+  { "East",      Magick::EastGravity },
+  { "SouthWest", Magick::SouthWestGravity },
+  { "South",     Magick::SouthGravity },
+  { "SouthEast", Magick::SouthEastGravity },
+  { NULL,        Magick::ForgetGravity }
+};
+
+static Magick::GravityType ParseGravity(const char *gravity) {
+  for (int i = 0; gravities[i].name; i++)
+    if (strcmp(gravities[i].name, gravity) == 0)
+      return gravities[i].gravity;
+  return Magick::ForgetGravity;
+}
+
+static size_t ImageBytes(const Magick::Image &image) {
+  return image.columns() * image.rows() * sizeof(Magick::PixelPacket);
+}
+
+// overlay image scaled for an image outputWidth wide, or the original if scale is 0
+static Magick::Image ScaleOverlay(const Magick::Image &original, double scale, unsigned int outputWidth) {
+  Magick::Image overlay(original);
+  if (!scale)
+    return overlay;
+
+  unsigned int width  = (unsigned int) floor(outputWidth * scale + 0.5);
+  unsigned int height = (unsigned int) floor((double) width * original.rows() / original.columns() + 0.5);
+  if (!width || !height)
+    return overlay;
+
+  Magick::Geometry geometry(width, height);
+  geometry.aspect(true);
+  overlay.resize(geometry);
+  return overlay;
+}
+
+void InitOverlayRegistry() {
+  uv_mutex_init(&registryMutex);
+}
+
+Overlay *DecodeOverlay(const Magick::Blob &blob, const std::string &format, const char *gravity, double scale, const std::vector<unsigned int> &outputWidths) {
+  Overlay *overlay = new Overlay();
+  try {
+    ReadImage(overlay->image, blob, format);
+  } catch (...) {
+    delete overlay;
+    throw;
+  }
+  overlay->gravity = ParseGravity(gravity);
+  overlay->scale   = scale;
+  overlay->bytes   = ImageBytes(overlay->image);
+
+  for (size_t i = 0; i < outputWidths.size(); i++) {
+    if (!scale || overlay->scaled.count(outputWidths[i]))
+      continue;
+    Magick::Image scaled = ScaleOverlay(overlay->image, scale, outputWidths[i]);
+    overlay->bytes += ImageBytes(scaled);
+    overlay->scaled[ outputWidths[i] ] = scaled;
+  }
+  return overlay;
+}
+
+size_t AddOverlay(const std::string &name, Overlay *overlay, size_t *releasedBytes) {
+  Overlay *replaced = NULL;
+  uv_mutex_lock(&registryMutex);
+  std::map<std::string, Overlay*>::iterator it = registry.find(name);
+  if (it != registry.end())
+    replaced = it->second;
+  registry[ name ] = overlay;
+  uv_mutex_unlock(&registryMutex);
+
+  *releasedBytes = 0;
+  if (replaced) {
+    // workers compositing it hold their own references to its images
+    *releasedBytes = replaced->bytes;
+    delete replaced;
+  }
+  return overlay->bytes;
+}
+
+void DeleteOverlay(Overlay *overlay) {
+  delete overlay;
+}
+
+size_t RemoveOverlay(const std::string &name) {
+  Overlay *overlay = NULL;
+  uv_mutex_lock(&registryMutex);
+  std::map<std::string, Overlay*>::iterator it = registry.find(name);
+  if (it != registry.end()) {
+    overlay = it->second;
+    registry.erase(it);
+  }
+  uv_mutex_unlock(&registryMutex);
+
+  if (!overlay)
+    return 0;
+  size_t bytes = overlay->bytes;
+  delete overlay;
+  return bytes;
+}
+
+bool HasOverlay(const std::string &name) {
+  uv_mutex_lock(&registryMutex);
+  bool found = registry.count(name) > 0;
+  uv_mutex_unlock(&registryMutex);
+  return found;
+}
+
+bool IsValidGravity(const char *gravity) {
+  return ParseGravity(gravity) != Magick::ForgetGravity;
+}
+
+const char *CompositeOverlay(Magick::Image &image, const std::string &name, int debug) {
+  unsigned int outputWidth = image.columns();
+  Magick::Image overlay;
+  Magick::Image original;
+  Magick::GravityType gravity;
+  double scale;
+  bool prescaled = false;
+
+  // copy out what we need, the images are reference counted
+  uv_mutex_lock(&registryMutex);
+  std::map<std::string, Overlay*>::iterator it = registry.find(name);
+  if (it == registry.end()) {
+    uv_mutex_unlock(&registryMutex);
+    return "overlay is not registered";
+  }
+  gravity = it->second->gravity;
+  scale   = it->second->scale;
+  std::map<unsigned int, Magick::Image>::iterator scaledIt = it->second->scaled.find(outputWidth);
+  if (scaledIt != it->second->scaled.end()) {
+    overlay   = scaledIt->second;
+    prescaled = true;
+  } else {
+    original  = it->second->image;
+  }
+  uv_mutex_unlock(&registryMutex);
+
+  if (!prescaled)
+    overlay = ScaleOverlay(original, scale, outputWidth);
+
+  if (debug) printf("composite: %s %dx%d%s\n", name.c_str(), (int) overlay.columns(), (int) overlay.rows(), prescaled ? " (pre-scaled)" : "");
+
+  image.composite(overlay, gravity, Magick::OverCompositeOp);
+  return NULL;
+}
@@ -0,0 +1,44 @@
+#ifndef OVERLAY_H
+#define OVERLAY_H
+
+#include <Magick++.h>
+#include <string>
+#include <vector>
+
+// Overlays (watermarks) are decoded once by registerOverlay() and kept in native memory,
+// together with copies pre-scaled for the output widths the caller expects to produce.
+// Workers composite them right after resize, without decoding or, for those widths, scaling.
+//
+// Overlays are decoded on worker threads, registered and unregistered on the main thread,
+// and looked up on worker threads.
+
+struct Overlay;
+
+void InitOverlayRegistry();
+
+// decodes blob with the decoder for format, see formats.h, and pre-scales it.
+//   gravity:      where to place the overlay, ex: "SouthEast"
+//   scale:        overlay width relative to the output width, 0 keeps the overlay's own size
+//   outputWidths: output widths to pre-scale the overlay for
+// to be called on worker threads. throws on decode errors
+Overlay *DecodeOverlay(const Magick::Blob &blob, const std::string &format, const char *gravity, double scale, const std::vector<unsigned int> &outputWidths);
+
+// registers overlay as name, replacing a previous overlay of the same name, and takes ownership of it.
+// returns the native bytes now held by the overlay, replaced overlays' bytes in *releasedBytes
+size_t AddOverlay(const std::string &name, Overlay *overlay, size_t *releasedBytes);
+
+// frees a decoded overlay that wasn't registered
+void DeleteOverlay(Overlay *overlay);
+
+// returns the native bytes released, 0 if name wasn't registered
+size_t RemoveOverlay(const std::string &name);
+
+bool HasOverlay(const std::string &name);
+
+// returns false if gravity isn't one of NorthWest, North, NorthEast, West, Center, East, SouthWest, South, SouthEast
+bool IsValidGravity(const char *gravity);
+
+// composites the overlay onto image. returns NULL or an error message
+const char *CompositeOverlay(Magick::Image &image, const std::string &name, int debug);
+
+#endif // OVERLAY_H
@@ -0,0 +1,496 @@
+#ifndef BUILDING_NODE_EXTENSION
+#define BUILDING_NODE_EXTENSION
+#endif  // BUILDING_NODE_EXTENSION
+
+#include "tile_pyramid.h"
+#include "formats.h"
+#include "native_memory.h"
+#include <ctype.h>
+#include <errno.h>
+#include <stdexcept>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <direct.h>
+#endif
+
+// tiles encoded ahead of onTile, per tile thread
+#define PENDING_TILES_PER_THREAD 4
+
+// decoders that hand rows to ReadStream one at a time, top to bottom.
+// others are decoded whole before tiling
+static const char *STREAMED_FORMATS[] = {"JPEG", "JPG", "PNG", "WEBP", NULL};
+
+static bool IsStreamed(const std::string &format) {
+  for (const char **f = STREAMED_FORMATS; *f; f++)
+    if (format == *f)
+      return true;
+  return false;
+}
+
+static bool MakeDirectory(const std::string &path) {
+#ifdef _WIN32
+  int ret = _mkdir(path.c_str());
+#else
+  int ret = mkdir(path.c_str(), 0755);
+#endif
+  return ret == 0 || errno == EEXIST;
+}
+
+TilePyramidWorker::TilePyramidWorker(NanCallback *callback, NanCallback *onTile, int debug, Magick::Blob srcBlob, const char *srcPath, const char *outDir, unsigned int tileSize, unsigned int overlap, const char *format, unsigned int quality, unsigned int threads):MagickWorker(callback, srcBlob) {
+  this->debug     = debug;
+  this->onTile    = onTile;
+  this->srcPath   = srcPath;
+  this->outDir    = outDir;
+  this->tileSize  = tileSize;
+  this->overlap   = overlap;
+  this->format    = format;
+  this->quality   = quality;
+  this->threads   = threads;
+  this->matte     = false;
+  this->wholeRead = false;
+  this->bands     = 0;
+  this->decoding  = false;
+  this->tileCount = 0;
+  this->width     = 0;
+  this->height    = 0;
+  this->levels    = 0;
+
+  for (const char *c = format; *c; c++)
+    extension.push_back(tolower(*c));
+  if (extension == "jpeg")
+    extension = "jpg";
+
+  uv_mutex_init(&mutex);
+  uv_cond_init(&drained);
+  uv_cond_init(&taskReady);
+  uv_cond_init(&bandDone);
+
+  // tiles are handed to the main thread through this, it must be created there
+  this->async = NULL;
+  if (onTile) {
+    async = new uv_async_t;
+    async->data = this;
+    uv_async_init(uv_default_loop(), async, OnTileAsync);
+  }
+};
+TilePyramidWorker::~TilePyramidWorker() {
+  if (onTile)
+    delete onTile;
+  if (srcPath)
+    delete[] srcPath;
+  if (outDir)
+    delete[] outDir;
+  if (format)
+    delete[] format;
+  uv_cond_destroy(&bandDone);
+  uv_cond_destroy(&taskReady);
+  uv_cond_destroy(&drained);
+  uv_mutex_destroy(&mutex);
+};
+
+size_t TilePyramidWorker::DecodedCost(size_t columns, size_t rows) const {
+  if (!IsStreamed(srcFormat))
+    return MagickWorker::DecodedCost(columns, rows);
+  // strips of all levels, under twice the top one, and up to `threads` bands queued for encoding
+  size_t strip = tileSize + 2 * overlap;
+  if (strip > rows)
+    strip = rows;
+  return columns * strip * (2 + threads) * sizeof(Magick::PixelPacket);
+}
+
+void TilePyramidWorker::Fail(const std::string &error) {
+  uv_mutex_lock(&mutex);
+  if (message.empty())
+    message = error;
+  // unblock threads waiting for onTile, tasks or bands, they stop at their next check
+  uv_cond_broadcast(&drained);
+  uv_cond_broadcast(&taskReady);
+  uv_cond_broadcast(&bandDone);
+  uv_mutex_unlock(&mutex);
+}
+
+bool TilePyramidWorker::Failed() {
+  uv_mutex_lock(&mutex);
+  bool failed = !message.empty();
+  uv_mutex_unlock(&mutex);
+  return failed;
+}
+
+void TilePyramidWorker::EncodeTile(PyramidBand *band, unsigned int column) {
+  // Deep Zoom tiles overlap their neighbours by `overlap` pixels on inner edges.
+  // the band already holds the overlapping rows
+  size_t x = column * tileSize - (column ? overlap : 0);
+  size_t w = tileSize + (column ? overlap : 0) + overlap;
+  if (x + w > band->width)
+    w = band->width - x;
+
+  Magick::Image tile(Magick::Geometry(w, band->height), Magick::Color());
+  tile.matte(matte);
+  Magick::PixelPacket *pixels = tile.getPixels(0, 0, w, band->height);
+  for (size_t y = 0; y < band->height; y++)
+    memcpy(pixels + y * w, &band->pixels[y * band->width + x], w * sizeof(Magick::PixelPacket));
+  tile.syncPixels();
+  tile.magick(format);
+  if (quality)
+    tile.quality(quality);
+
+  if (outDir) {
+    char name[64];
+    snprintf(name, sizeof(name), "/%u/%u_%u.", band->level, column, band->row);
+    tile.write(std::string(outDir) + name + extension);
+
+    uv_mutex_lock(&mutex);
+    tileCount++;
+    uv_mutex_unlock(&mutex);
+    return;
+  }
+
+  PyramidTile encoded;
+  encoded.level  = band->level;
+  encoded.column = column;
+  encoded.row    = band->row;
+  tile.write(&encoded.blob);
+
+  uv_mutex_lock(&mutex);
+  while (pending.size() >= threads * PENDING_TILES_PER_THREAD && message.empty())
+    uv_cond_wait(&drained, &mutex);
+  pending.push_back(encoded);
+  tileCount++;
+  uv_mutex_unlock(&mutex);
+  uv_async_send(async);
+}
+
+// called with mutex held
+void TilePyramidWorker::FinishTask(PyramidBand *band) {
+  if (--band->remaining)
+    return;
+  delete band;
+  bands--;
+  uv_cond_broadcast(&bandDone);
+}
+
+// encodes one queued tile, returns false if there is none.
+// called and returns with mutex held
+bool TilePyramidWorker::RunTask() {
+  if (tasks.empty() || !message.empty())
+    return false;
+  PyramidTask task = tasks.front();
+  tasks.pop_front();
+  uv_mutex_unlock(&mutex);
+
+  try {
+    EncodeTile(task.band, task.column);
+  } catch (std::exception& err) {
+    std::string error = "tile encode failed with error: ";
+    error            += err.what();
+    Fail(error);
+  } catch (...) {
+    Fail("unhandled error");
+  }
+
+  uv_mutex_lock(&mutex);
+  FinishTask(task.band);
+  return true;
+}
+
+void TilePyramidWorker::EncodeTasks() {
+  uv_mutex_lock(&mutex);
+  for (;;) {
+    if (RunTask())
+      continue;
+    if (!decoding || !message.empty())
+      break;
+    uv_cond_wait(&taskReady, &mutex);
+  }
+  uv_mutex_unlock(&mutex);
+}
+
+void TilePyramidWorker::TileThread(void *arg) {
+  static_cast<TilePyramidWorker*>(arg)->EncodeTasks();
+}
+
+// sizes the levels from the source and starts the tile threads
+bool TilePyramidWorker::Start(unsigned int width, unsigned int height, bool matte) {
+  this->width  = width;
+  this->height = height;
+  this->matte  = matte;
+  unsigned int maxLevel = 0;
+  while ((1u << maxLevel) < (width > height ? width : height))
+    maxLevel++;
+  levels = maxLevel + 1;
+  if (debug) printf("pyramid: %d x %d, %d levels\n", width, height, levels);
+
+  pyramid.resize(levels);
+  for (int l = maxLevel; l >= 0; l--) {
+    PyramidLevel &level = pyramid[l];
+    level.width    = width;
+    level.height   = height;
+    level.columns  = (width + tileSize - 1) / tileSize;
+    level.rows     = (height + tileSize - 1) / tileSize;
+    level.received = 0;
+    level.tileRow  = 0;
+    level.bandTop  = 0;
+    if (debug) printf("level %d: %d x %d, %d x %d tiles\n", l, width, height, level.columns, level.rows);
+
+    if (outDir) {
+      char name[16];
+      snprintf(name, sizeof(name), "/%d", l);
+      if (!MakeDirectory(std::string(outDir) + name)) {
+        Fail("mkdir failed: " + std::string(outDir) + name);
+        return false;
+      }
+    }
+    width  = (width + 1) / 2;
+    height = (height + 1) / 2;
+  }
+
+  decoding = true;
+  tids.resize(threads - 1);
+  for (unsigned int i = 0; i < tids.size(); i++)
+    uv_thread_create(&tids[i], TileThread, this);
+  return true;
+}
+
+// queues the tile row the band of level has just completed
+void TilePyramidWorker::CutBand(unsigned int l) {
+  PyramidLevel &level = pyramid[l];
+  PyramidBand *band = new PyramidBand;
+  band->level     = l;
+  band->row       = level.tileRow;
+  band->width     = level.width;
+  band->height    = level.received - level.bandTop;
+  band->remaining = level.columns;
+
+  if (level.tileRow + 1 < level.rows) {
+    // the next tile row starts `overlap` rows above the end of this one
+    unsigned int top = (level.tileRow + 1) * tileSize - overlap;
+    band->pixels = level.band;
+    level.band.erase(level.band.begin(), level.band.begin() + (size_t)(top - level.bandTop) * level.width);
+    level.bandTop = top;
+  } else {
+    band->pixels.swap(level.band);
+  }
+  level.tileRow++;
+
+  uv_mutex_lock(&mutex);
+  for (unsigned int column = 0; column < level.columns; column++) {
+    PyramidTask task;
+    task.band   = band;
+    task.column = column;
+    tasks.push_back(task);
+  }
+  bands++;
+  uv_cond_broadcast(&taskReady);
+  // past threads - 1 queued bands, the decoding thread encodes tiles itself
+  while (bands >= threads && message.empty()) {
+    if (!RunTask())
+      uv_cond_wait(&bandDone, &mutex);
+  }
+  uv_mutex_unlock(&mutex);
+}
+
+// appends a row to level l, halving every two rows into level l - 1
+bool TilePyramidWorker::AddRow(unsigned int l, const Magick::PixelPacket *pixels) {
+  PyramidLevel &level = pyramid[l];
+  unsigned int y = level.received++;
+  level.band.insert(level.band.end(), pixels, pixels + level.width);
+
+  // rows of a tile row overlap the next one by `overlap`, so a short last tile row
+  // may complete with the one above it
+  for (;;) {
+    unsigned int bottom = (level.tileRow + 1) * tileSize + overlap;
+    if (level.tileRow >= level.rows || level.received < (bottom < level.height ? bottom : level.height))
+      break;
+    CutBand(l);
+  }
+  if (Failed())
+    return false;
+  if (!l)
+    return true;
+
+  if (y % 2 == 0) {
+    level.evenRow.assign(pixels, pixels + level.width);
+    if (y + 1 < level.height)
+      return true;
+  }
+
+  // 2x2 box filter, the odd last row and column average what there is
+  const Magick::PixelPacket *odd = y % 2 ? pixels : NULL;
+  PyramidLevel &next = pyramid[l - 1];
+  std::vector<Magick::PixelPacket> half(next.width);
+  for (unsigned int x = 0; x < next.width; x++) {
+    double red = 0, green = 0, blue = 0, opacity = 0;
+    unsigned int count = 0;
+    for (unsigned int sx = 2 * x; sx < 2 * x + 2 && sx < level.width; sx++) {
+      const Magick::PixelPacket *sources[] = {&level.evenRow[sx], odd ? &odd[sx] : NULL};
+      for (int i = 0; i < 2 && sources[i]; i++) {
+        red     += sources[i]->red;
+        green   += sources[i]->green;
+        blue    += sources[i]->blue;
+        opacity += sources[i]->opacity;
+        count++;
+      }
+    }
+    half[x].red     = (MagickCore::Quantum)(red / count + 0.5);
+    half[x].green   = (MagickCore::Quantum)(green / count + 0.5);
+    half[x].blue    = (MagickCore::Quantum)(blue / count + 0.5);
+    half[x].opacity = (MagickCore::Quantum)(opacity / count + 0.5);
+  }
+  return AddRow(l - 1, &half[0]);
+}
+
+size_t TilePyramidWorker::StreamRow(const MagickCore::Image *image, const void *pixels, const size_t columns) {
+  TilePyramidWorker *worker = static_cast<TilePyramidWorker*>(image->client_data);
+  if (worker->pyramid.empty()) {
+    // streamed rows carry neither colormap indexes nor the black channel
+    if (image->storage_class == MagickCore::PseudoClass || image->colorspace == MagickCore::CMYKColorspace) {
+      worker->wholeRead = true;
+      return 0;
+    }
+    if (!worker->Start(image->columns, image->rows, image->matte != MagickCore::MagickFalse))
+      return 0;
+  }
+
+  PyramidLevel &top = worker->pyramid[worker->levels - 1];
+  if (columns != top.width || top.received >= top.height) {
+    worker->Fail("image.read failed with error: decoder streamed an unexpected row");
+    return 0;
+  }
+  if (!worker->AddRow(worker->levels - 1, static_cast<const Magick::PixelPacket*>(pixels)))
+    return 0;
+  return columns;
+}
+
+void TilePyramidWorker::ReadStreamed() {
+  MagickCore::ImageInfo *info = MagickCore::CloneImageInfo(NULL);
+  std::string spec = srcFormat + ":";
+  if (srcPath)
+    spec += srcPath;
+  else
+    MagickCore::SetImageInfoBlob(info, srcBlob.data(), srcBlob.length());
+  MagickCore::CopyMagickString(info->filename, spec.c_str(), MaxTextExtent);
+  info->client_data = this;
+
+  MagickCore::ExceptionInfo *exception = MagickCore::AcquireExceptionInfo();
+  MagickCore::Image *image = MagickCore::ReadStream(info, &StreamRow, exception);
+  if (image)
+    MagickCore::DestroyImageList(image);
+  // a row we refused shows up here too, Fail keeps the first error
+  if (exception->severity >= MagickCore::ErrorException && !wholeRead) {
+    std::string error = "image.read failed with error: ";
+    error += exception->reason ? exception->reason : "unknown";
+    if (exception->description) {
+      error += " (";
+      error += exception->description;
+      error += ")";
+    }
+    Fail(error);
+  }
+  MagickCore::DestroyExceptionInfo(exception);
+  MagickCore::DestroyImageInfo(info);
+}
+
+void TilePyramidWorker::ReadWhole() {
+  try {
+    Magick::Image image;
+    if (srcPath)
+      ReadImageFile(image, srcPath, srcFormat);
+    else
+      ReadImage(image, srcBlob, srcFormat);
+    if (image.colorSpace() == Magick::CMYKColorspace)
+      image.colorSpace(Magick::sRGBColorspace);
+
+    if (!Start(image.columns(), image.rows(), image.matte()))
+      return;
+    for (unsigned int y = 0; y < height; y++)
+      if (!AddRow(levels - 1, image.getConstPixels(0, y, width, 1)))
+        return;
+  } catch (std::exception& err) {
+    std::string error = "image.read failed with error: ";
+    error            += err.what();
+    Fail(error);
+  } catch (...) {
+    Fail("unhandled error");
+  }
+}
+
+void TilePyramidWorker::Execute() {
+  if (IsStreamed(srcFormat))
+    ReadStreamed();
+  if (!IsStreamed(srcFormat) || wholeRead) {
+    if (debug) printf("pyramid: decoding whole\n");
+    ReadWhole();
+  }
+  if (!Failed() && (pyramid.empty() || pyramid[levels - 1].received < height))
+    Fail("image.read failed with error: image data ended early");
+
+  // tiles of the last bands, then the threads stop
+  uv_mutex_lock(&mutex);
+  decoding = false;
+  uv_cond_broadcast(&taskReady);
+  while (RunTask());
+  uv_mutex_unlock(&mutex);
+  for (unsigned int i = 0; i < tids.size(); i++)
+    uv_thread_join(&tids[i]);
+
+  // bands left behind by a failure
+  while (!tasks.empty()) {
+    FinishTask(tasks.front().band);
+    tasks.pop_front();
+  }
+  if (!message.empty())
+    this->errmsg = message.c_str();
+};
+
+void TilePyramidWorker::DeliverTiles() {
+  NanScope();
+  std::deque<PyramidTile> tiles;
+  uv_mutex_lock(&mutex);
+  tiles.swap(pending);
+  uv_cond_broadcast(&drained);
+  uv_mutex_unlock(&mutex);
+
+  for (size_t i = 0; i < tiles.size(); i++) {
+    Local<Object> tile = Object::New();
+    tile->Set(NanSymbol("level"), Integer::New(tiles[i].level));
+    tile->Set(NanSymbol("column"), Integer::New(tiles[i].column));
+    tile->Set(NanSymbol("row"), Integer::New(tiles[i].row));
+    tile->Set(NanSymbol("data"), NativeMemoryBuffer(tiles[i].blob));
+    Local<Value> argv[] = {tile};
+    onTile->Call(1, argv);
+  }
+}
+
+void TilePyramidWorker::OnTileAsync(uv_async_t *handle, int status) {
+  static_cast<TilePyramidWorker*>(handle->data)->DeliverTiles();
+}
+
+void TilePyramidWorker::OnAsyncClose(uv_handle_t *handle) {
+  delete (uv_async_t*) handle;
+}
+
+void TilePyramidWorker::WorkComplete() {
+  if (async) {
+    // tiles queued after the last async callback come before the final callback
+    DeliverTiles();
+    uv_close((uv_handle_t*) async, OnAsyncClose);
+    async = NULL;
+  }
+  MagickWorker::WorkComplete();
+};
+
+void TilePyramidWorker::HandleOKCallback() {
+  NanScope();
+  Local<Object> out = Object::New();
+  out->Set(NanSymbol("width"), Integer::New(width));
+  out->Set(NanSymbol("height"), Integer::New(height));
+  out->Set(NanSymbol("levels"), Integer::New(levels));
+  out->Set(NanSymbol("tileSize"), Integer::New(tileSize));
+  out->Set(NanSymbol("overlap"), Integer::New(overlap));
+  out->Set(NanSymbol("format"), String::New(extension.c_str()));
+  out->Set(NanSymbol("tiles"), Number::New(tileCount));
+  Local<Value> argv[] = {Local<Value>::New(Undefined()), out};
+  callback->Call(2, argv);
+};
@@ -0,0 +1,117 @@
+#ifndef TILE_PYRAMID_H
+#define TILE_PYRAMID_H
+
+#include <deque>
+#include <uv.h>
+#include "async_magick.h"
+
+struct PyramidTile {
+  unsigned int level;
+  unsigned int column;
+  unsigned int row;
+  Magick::Blob blob;
+};
+
+// rows of one level that the next tile row still needs
+struct PyramidLevel {
+  unsigned int width;
+  unsigned int height;
+  unsigned int columns;
+  unsigned int rows;
+  // rows received so far, and the tile row they complete next
+  unsigned int received;
+  unsigned int tileRow;
+  // rows [bandTop, received)
+  unsigned int bandTop;
+  std::vector<Magick::PixelPacket> band;
+  // even row waiting for its odd neighbour to be halved into the next level
+  std::vector<Magick::PixelPacket> evenRow;
+};
+
+// pixels of one tile row, shared by the threads encoding its tiles
+struct PyramidBand {
+  unsigned int level;
+  unsigned int row;
+  unsigned int width;
+  unsigned int height;
+  std::vector<Magick::PixelPacket> pixels;
+  // tiles not yet encoded, the last one deletes the band
+  unsigned int remaining;
+};
+
+struct PyramidTask {
+  PyramidBand *band;
+  unsigned int column;
+};
+
+// builds a Deep Zoom pyramid from a single decode, in strips.
+// source rows are streamed from the decoder and each level keeps only the rows its next tile row needs,
+// about tileSize + 2 * overlap rows. every two rows of a level are halved into a row of the next level,
+// so memory is O(width * tileSize) for the whole pyramid. formats the decoder can not stream row by row
+// (see STREAMED_FORMATS), palette and CMYK sources are decoded whole first, then fed through the same strips.
+// each completed tile row is queued as a band, its tiles are encoded by up to `threads` threads,
+// then either written to outDir/<level>/<column>_<row>.<ext> or passed to onTile.
+// tiles wait for onTile in a bounded queue, and bands in a bounded queue, which blocks decoding when JS falls behind.
+class TilePyramidWorker:public MagickWorker {
+  public:
+    TilePyramidWorker(NanCallback *callback, NanCallback *onTile, int debug, Magick::Blob srcBlob, const char *srcPath, const char *outDir, unsigned int tileSize, unsigned int overlap, const char *format, unsigned int quality, unsigned int threads);
+    ~TilePyramidWorker();
+    void Execute();
+    void HandleOKCallback();
+    void WorkComplete();
+    size_t DecodedCost(size_t columns, size_t rows) const;
+  private:
+    static size_t StreamRow(const MagickCore::Image *image, const void *pixels, const size_t columns);
+    static void TileThread(void *arg);
+    static void OnTileAsync(uv_async_t *handle, int status);
+    static void OnAsyncClose(uv_handle_t *handle);
+    void ReadStreamed();
+    void ReadWhole();
+    bool Start(unsigned int width, unsigned int height, bool matte);
+    bool AddRow(unsigned int level, const Magick::PixelPacket *pixels);
+    void CutBand(unsigned int level);
+    bool RunTask();
+    void FinishTask(PyramidBand *band);
+    void EncodeTasks();
+    void EncodeTile(PyramidBand *band, unsigned int column);
+    void DeliverTiles();
+    void Fail(const std::string &error);
+    bool Failed();
+
+    int debug;
+    NanCallback *onTile;
+    uv_async_t *async;
+    const char *srcPath;
+    const char *outDir;
+    const char *format;
+    std::string extension;
+    unsigned int tileSize;
+    unsigned int overlap;
+    unsigned int quality;
+    unsigned int threads;
+
+    // written by the decoding thread only
+    std::vector<PyramidLevel> pyramid;
+    bool matte;
+    // the stream was given up at its first row, the source is read whole instead
+    bool wholeRead;
+    std::vector<uv_thread_t> tids;
+
+    // guards everything below
+    uv_mutex_t mutex;
+    uv_cond_t drained;
+    uv_cond_t taskReady;
+    uv_cond_t bandDone;
+    std::deque<PyramidTask> tasks;
+    unsigned int bands;
+    bool decoding;
+    std::deque<PyramidTile> pending;
+    std::string message;
+    size_t tileCount;
+
+    unsigned int width;
+    unsigned int height;
+    unsigned int levels;
+};
+
+#endif // TILE_PYRAMID_H
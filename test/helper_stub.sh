@@ -0,0 +1,18 @@
+#!/bin/sh
+# stands in for imagemagick_helper in test/pool_child.js.
+# fails its first job as HELPER_STUB_MODE says, later spawns run the real helper.
+#   crash: dies with SIGSEGV
+#   hang:  never answers
+if [ -e "$HELPER_STUB_MARKER" ]; then
+    exec "$HELPER_STUB_REAL" "$@"
+fi
+
+# ready byte, then wait for the first request on the control socket
+printf '\001' >&3
+head -c 1 <&3 >/dev/null
+touch "$HELPER_STUB_MARKER"
+
+if [ "$HELPER_STUB_MODE" = "hang" ]; then
+    exec sleep 30
+fi
+kill -s SEGV $$
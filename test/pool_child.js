@@ -0,0 +1,30 @@
+// runs the worker pool with test/helper_stub.sh in its own process, since a pool starts once per process.
+// usage: node pool_child.js crash|hang, reports both jobs' results to the parent
+var imagemagick = require('..')
+,   fs          = require('fs')
+,   path        = require('path')
+,   mode        = process.argv[2]
+;
+
+process.env.HELPER_STUB_MODE   = mode;
+process.env.HELPER_STUB_MARKER = path.join( require('os').tmpdir(), 'imagemagick-helper-stub-' + process.pid );
+process.env.HELPER_STUB_REAL   = path.join( __dirname, '..', 'build', 'Release', 'imagemagick_helper' );
+
+imagemagick.setWorkerPool({ size: 1, timeout: 500, helperPath: path.join( __dirname, 'helper_stub.sh' ) });
+
+var srcData = fs.readFileSync( path.join( __dirname, 'test.png' ) )
+,   results = []
+;
+function done (index) {
+    return function (err, buffer) {
+        results[ index ] = { error: err ? err.message : null, length: buffer ? buffer.length : 0 };
+        if (!results[0] || !results[1])
+            return;
+        fs.unlinkSync( process.env.HELPER_STUB_MARKER );
+        process.send( results );
+        process.disconnect();
+    };
+}
+// one helper: the second job waits for the first, then runs in the respawned helper
+imagemagick.convert({ srcData: srcData, width: 10, format: 'PNG', coalesce: false }, done(0));
+imagemagick.convert({ srcData: srcData, width: 20, format: 'PNG', coalesce: false }, done(1));
@@ -160,6 +160,227 @@ test( 'convert broken png', function (t) {
     t.end();
 });
 
+test( 'convert maxPixels', function (t) {
+    imagemagick.convert({
+        srcData: require('fs').readFileSync( "./test/test.png" ), // 58x66
+        width: 10,
+        height: 10,
+        maxPixels: 100,
+        debug: debug
+    }, function (err, buffer) {
+        t.equal( err.code, 'EMAXPIXELS', 'err code' );
+        t.equal( err.message, 'image exceeds maxPixels: 58x66', 'err message' );
+        t.equal( buffer, undefined, 'buffer undefined' );
+        t.end();
+    });
+});
+
+test( 'convert maxPixels rejects asynchronously', function (t) {
+    var returned = false;
+    imagemagick.convert({
+        srcData: require('fs').readFileSync( "./test/test.png" ), // 58x66
+        maxPixels: 100,
+        debug: debug
+    }, function (err) {
+        t.equal( err.code, 'EMAXPIXELS', 'err code' );
+        t.ok( returned, 'callback runs after convert() returned' );
+        t.end();
+    });
+    returned = true;
+});
+
+test( 'memoryUsage accounts output Buffers', function (t) {
+    imagemagick.convert({
+        srcData: require('fs').readFileSync( "./test/test.jpg" ),
+        width: 100,
+        height: 100,
+        format: 'JPEG',
+        debug: debug
+    }, function (err, buffer) {
+        var usage = imagemagick.memoryUsage();
+        t.ok( usage.output >= buffer.length, 'output includes the Buffer' );
+        t.equal( usage.total, usage.input + usage.pixels + usage.output, 'total is the sum' );
+        t.end();
+    });
+});
+
+test( 'load options and shared pixel accounting', function (t) {
+    var srcData = require('fs').readFileSync( "./test/test.png" ); // 58x66
+    imagemagick.load( srcData, { maxPixels: 100, debug: debug }, function (err, handle) {
+        t.equal( err.code, 'EMAXPIXELS', 'maxPixels option is read' );
+        t.equal( handle, undefined, 'no handle' );
+
+        var before = imagemagick.memoryUsage().handles;
+        imagemagick.load( srcData, { inputFormat: 'PNG', debug: debug }, function (err, handle) {
+            t.equal( err, undefined, 'no error' );
+            var handles = imagemagick.memoryUsage().handles;
+
+            handle.orient(function (err, oriented) {
+                t.equal( imagemagick.memoryUsage().handles, handles, 'upright orient() shares pixels, charged once' );
+                handle.dispose();
+                t.equal( imagemagick.memoryUsage().handles, handles, 'still charged to the oriented handle' );
+                oriented.dispose();
+                t.equal( imagemagick.memoryUsage().handles, before, 'released with the last handle' );
+                t.end();
+            });
+        });
+    });
+});
+
+test( 'load, resize and encode a handle', function (t) {
+    imagemagick.load( require('fs').readFileSync( "./test/test.png" ), function (err, handle) { // 58x66
+        t.equal( err, undefined, 'no error' );
+        t.equal( handle.width, 58, 'width is 58' );
+        t.equal( handle.height, 66, 'height is 66' );
+        t.ok( imagemagick.memoryUsage().handles > 0, 'handle is accounted' );
+
+        handle.resize({ width: 20, height: 20, resizeStyle: 'fill' }, function (err, resized) {
+            t.equal( resized.width, 20, 'resized width is 20' );
+            t.equal( handle.width, 58, 'original handle is unchanged' );
+
+            resized.encode({ format: 'PNG' }, function (err, buffer) {
+                t.equal( Buffer.isBuffer(buffer), true, 'buffer is Buffer' );
+                saveToFileIfDebug( buffer, "./test/out.handle.png" );
+
+                handle.dispose();
+                resized.dispose();
+                var error = 0;
+                try {
+                    handle.encode({}, function () {});
+                } catch (e) {
+                    error = e;
+                }
+                t.equal( error.message, 'ImageHandle is disposed' );
+                t.end();
+            });
+        });
+    });
+});
+
+test( 'convert composite registered overlay', function (t) {
+    imagemagick.registerOverlay( 'logo', require('fs').readFileSync( "./test/test.png" ), {
+        gravity: 'SouthEast',
+        scale: 0.25,
+        outputWidths: [ 100 ]
+    }, function (err) {
+        t.equal( err, undefined, 'no error' );
+        t.ok( imagemagick.memoryUsage().overlays > 0, 'overlay is accounted' );
+
+        imagemagick.convert({
+            srcData: require('fs').readFileSync( "./test/test.jpg" ),
+            width: 100,
+            height: 100,
+            format: 'JPEG',
+            composite: 'logo',
+            debug: debug
+        }, function (err, buffer) {
+            t.equal( err, undefined, 'no error' );
+            t.equal( Buffer.isBuffer(buffer), true, 'buffer is Buffer' );
+            saveToFileIfDebug( buffer, "./test/out.composite.jpg" );
+
+            imagemagick.unregisterOverlay( 'logo' );
+            var error = 0;
+            try {
+                imagemagick.convert({
+                    srcData: require('fs').readFileSync( "./test/test.jpg" ),
+                    composite: 'logo'
+                }, function () {});
+            } catch (e) {
+                error = e;
+            }
+            t.equal( error.message, 'overlay "logo" is not registered' );
+            t.end();
+        });
+    });
+});
+
+test( 'registerOverlay is admitted like other jobs', function (t) {
+    var error = 0;
+    try {
+        imagemagick.registerOverlay( 'logo', require('fs').readFileSync( "./test/test.png" ) );
+    } catch (e) {
+        error = e;
+    }
+    t.equal( error.message, 'registerOverlay() requires a name, a Buffer and a callback argument!' );
+
+    var returned = false;
+    imagemagick.registerOverlay( 'big', require('fs').readFileSync( "./test/test.png" ), { maxPixels: 100 }, function (err) { // 58x66
+        t.equal( err.code, 'EMAXPIXELS', 'err code' );
+        t.ok( returned, 'callback runs after registerOverlay() returned' );
+        t.equal( imagemagick.memoryUsage().overlays, 0, 'nothing is registered' );
+        t.end();
+    });
+    returned = true;
+});
+
+test( 'convert options are validated before allocating', function (t) {
+    var error = 0;
+    try {
+        imagemagick.convert({
+            srcData: require('fs').readFileSync( "./test/test.jpg" ),
+            resizeStyle: 'fill',
+            format: 'PNG',
+            outOfProcess: true
+        }, function () {});
+    } catch (e) {
+        error = e;
+    }
+    t.equal( error.message, '"outOfProcess" requires setWorkerPool() and no "composite"' );
+    t.end();
+});
+
+test( 'tilePyramid onTile', function (t) {
+    var tiles = 0;
+    imagemagick.tilePyramid({
+        srcData: require('fs').readFileSync( "./test/test.png" ), // 58x66
+        tileSize: 32,
+        overlap: 1,
+        format: 'PNG',
+        onTile: function (tile) {
+            t.equal( Buffer.isBuffer(tile.data), true, 'tile data is Buffer' );
+            tiles++;
+        },
+        debug: debug
+    }, function (err, info) {
+        t.equal( err, undefined, 'no error' );
+        t.equal( info.levels, 8, '66px needs 8 levels' );
+        t.equal( info.tiles, tiles, 'all tiles delivered before callback' );
+        t.end();
+    });
+});
+
+test( 'tilePyramid outDir', function (t) {
+    var fs     = require('fs')
+    ,   outDir = require('os').tmpdir() + '/tilePyramid-' + process.pid
+    ;
+    fs.mkdirSync( outDir );
+    imagemagick.tilePyramid({
+        srcPath: "./test/test.png", // 58x66
+        outDir: outDir,
+        tileSize: 32,
+        overlap: 1,
+        format: 'PNG',
+        threads: 2,
+        debug: debug
+    }, function (err, info) {
+        t.equal( err, undefined, 'no error' );
+        t.equal( info.levels, 8, '66px needs 8 levels' );
+        t.ok( fs.existsSync( outDir + '/7/1_2.png' ), 'last tile row of 2px written' );
+        t.ok( fs.existsSync( outDir + '/0/0_0.png' ), '1x1 level written' );
+        var files = 0;
+        for (var level = 0; level < info.levels; level++) {
+            var names = fs.readdirSync( outDir + '/' + level );
+            files += names.length;
+            names.forEach( function (name) { fs.unlinkSync( outDir + '/' + level + '/' + name ); } );
+            fs.rmdirSync( outDir + '/' + level );
+        }
+        fs.rmdirSync( outDir );
+        t.equal( info.tiles, 14, '2x3 + 1x2 + 1 per level below' );
+        t.equal( files, info.tiles, 'every tile written' );
+        t.end();
+    });
+});
+
 test( 'identify invalid number of arguments', function (t) {
     var error = 0;
     try {
@@ -169,34 +390,90 @@ test( 'identify invalid number of arguments', function (t) {
     }
     
     t.equal( error.name, 'Error' );
-    t.equal( error.message, 'identify() requires 1 (option) argument!' );
+    t.equal( error.message, 'identify() requires one option argument and one callback argument!' );
     t.end();
 });
 
 test( 'identify srcData is a Buffer', function (t) {
-    var buffer;
+    var error = 0;
     try {
-        buffer = imagemagick.identify({
+        imagemagick.identify({
             srcData: require('fs').readFileSync( "./test/test.png", 'binary' )
+        }, function () {
+            t.fail( 'callback should not be called' );
         });
     } catch (e) {
-        t.equal( e.message, "identify()'s 1st argument should have \"srcData\" key with a Buffer instance" );
+        error = e;
     }
-    t.equal( buffer, undefined, 'buffer undefined' );
+    t.equal( error.message, "identify()'s 1st argument should have \"srcData\" key with a Buffer instance" );
     t.end();
 });
 
 test( 'identify results', function (t) {
-    var results = imagemagick.identify({
+    imagemagick.identify({
         srcData: require('fs').readFileSync( "./test/test.png" )
+    }, function (err, results) {
+        t.equal( err, undefined, 'no error' );
+        t.equal( results.width, 58, 'width is 58' );
+        t.equal( results.height, 66, 'height is 66' );
+        t.equal( results.depth, 8, 'depth is 8' );
+        t.equal( results.format, 'PNG', 'format is PNG' );
+        t.end();
+    });
+});
+
+test( 'identify broken image fails the callback', function (t) {
+    imagemagick.identify({
+        srcData: require('fs').readFileSync( "./test/broken.png" )
+    }, function (err, results) {
+        t.ok( err instanceof Error, 'error passed to the callback' );
+        t.equal( results, undefined, 'no results' );
+        t.end();
+    });
+});
+
+test( 'convert analyze', function (t) {
+    imagemagick.convert({
+        srcData: require('fs').readFileSync( "./test/test.jpg" ),
+        width: 100,
+        height: 100,
+        format: 'JPEG',
+        analyze: { componentsX: 4, componentsY: 3 },
+        debug: debug
+    }, function (err, buffer, analysis) {
+        t.equal( err, undefined, 'no error' );
+        t.equal( Buffer.isBuffer(buffer), true, 'buffer is Buffer' );
+        t.similar( analysis.phash, /^[0-9a-f]{16}$/, 'phash is 64bit hex' );
+        t.equal( analysis.blurhash.length, 4 + 2 * 4 * 3, 'blurhash length matches components' );
+        t.end();
+    });
+});
+
+test( 'convert analyze components out of range', function (t) {
+    var srcData = require('fs').readFileSync( "./test/test.jpg" );
+    [ { componentsX: 0, componentsY: 3 }, { componentsX: 4, componentsY: 10 } ].forEach(function (analyze) {
+        var error = 0;
+        try {
+            imagemagick.convert({ srcData: srcData, analyze: analyze }, function () {});
+        } catch (e) {
+            error = e;
+        }
+        t.equal( error.message, '"analyze.componentsX" and "analyze.componentsY" should be between 1 and 9' );
     });
-    t.equal( results.width, 58, 'width is 58' );
-    t.equal( results.height, 66, 'height is 66' );
-    t.equal( results.depth, 8, 'depth is 8' );
-    t.equal( results.format, 'PNG', 'format is PNG' );
     t.end();
 });
 
+test( 'identify analyze', function (t) {
+    imagemagick.identify({
+        srcData: require('fs').readFileSync( "./test/test.jpg" ),
+        analyze: true
+    }, function (err, results) {
+        t.similar( results.phash, /^[0-9a-f]{16}$/, 'phash is 64bit hex' );
+        t.equal( results.blurhash.length, 4 + 2 * 4 * 3, 'default blurhash is 4x3' );
+        t.end();
+    });
+});
+
 test( 'quantizeColors invalid number of arguments', function (t) {
     var error = 0;
     try {
@@ -206,7 +483,7 @@ test( 'quantizeColors invalid number of arguments', function (t) {
     }
     
     t.equal( error.name, 'Error' );
-    t.equal( error.message, 'quantizeColors() requires 1 (option) argument!' );
+    t.equal( error.message, 'quantizeColors() requires one option argument and one callback argument!' );
     t.end();
 });
 
@@ -215,7 +492,7 @@ test( 'quantizeColors srcData is a Buffer', function (t) {
     try {
         buffer = imagemagick.quantizeColors({
             srcData: require('fs').readFileSync( "./test/test.png", 'binary' )
-        });
+        }, function () {});
     } catch (e) {
         t.equal( e.message, "quantizeColors()'s 1st argument should have \"srcData\" key with a Buffer instance" );
     }
@@ -223,50 +500,320 @@ test( 'quantizeColors srcData is a Buffer', function (t) {
     t.end();
 });
 
+// colors come from a downscaled, undithered proxy, so only structure and tolerances are asserted
+function checkQuantizedColors (t, results) {
+    var total = 0;
+    results.forEach(function (color, i) {
+        [ 'r', 'g', 'b' ].forEach(function (channel) {
+            t.ok( color[channel] >= 0 && color[channel] <= 255 && color[channel] % 1 === 0, 'results['+i+'].'+channel+' is 0-255' );
+        });
+        t.equal( color.hex, ((1 << 24) + (color.r << 16) + (color.g << 8) + color.b).toString(16).slice(1), 'results['+i+'] hex matches rgb' );
+        if (i)
+            t.ok( results[i-1].share >= color.share, 'results['+i+'] sorted by pixel share' );
+        total += color.share;
+    });
+    t.ok( Math.abs(total - 1) < 1e-6, 'shares sum to 1' );
+}
+
 test( 'quantizeColors results, 1 color', function (t) {
-    var results = imagemagick.quantizeColors({
+    imagemagick.quantizeColors({
         srcData: require('fs').readFileSync( "./test/test.quantizeColors.png" ),
         colors: 1
+    }, function (err, results) {
+        t.equal( err, undefined, 'no error' );
+        t.equal( results.length, 1, '1 color' );
+        checkQuantizedColors( t, results );
+
+        // the source's mean color is 131, 117, 109
+        t.ok( Math.abs(results[0].r - 131) <= 40, 'results[0] red is near the mean' );
+        t.ok( Math.abs(results[0].g - 117) <= 40, 'results[0] green is near the mean' );
+        t.ok( Math.abs(results[0].b - 109) <= 40, 'results[0] blue is near the mean' );
+        t.end();
     });
-    
-    t.equal( results[0].r, 161, 'results[0] red is 161' );
-    t.equal( results[0].g, 93, 'results[0] green is 93' );
-    t.equal( results[0].b, 85, 'results[0] blue is 85' );
-    t.equal( results[0].hex, 'a15d55', 'results[0] hex is a15d55' );
-    
-    t.end();
 });
 
-
 test( 'quantizeColors results, 5 colors', function (t) {
-    var results = imagemagick.quantizeColors({
+    imagemagick.quantizeColors({
         srcData: require('fs').readFileSync( "./test/test.quantizeColors.png" )
+    }, function (err, results) {
+        t.equal( err, undefined, 'no error' );
+        t.equal( results.length, 5, '5 colors by default' );
+        checkQuantizedColors( t, results );
+
+        // a solid ff0000 block covers 20% of the source, the rest is a hue gradient
+        var red = results.filter(function (color) {
+            return color.r >= 200 && color.g <= 60 && color.b <= 60;
+        });
+        t.equal( red.length, 1, 'the red block is one color' );
+        t.ok( red[0].share >= 0.15, 'the red block keeps its share' );
+        t.end();
+    });
+});
+
+test( 'quantizeColors invalid colors', function (t) {
+    [ 0, -1, 2.5, 257, 'five' ].forEach(function (colors) {
+        var error = 0;
+        try {
+            imagemagick.quantizeColors({
+                srcData: require('fs').readFileSync( "./test/test.quantizeColors.png" ),
+                colors: colors
+            }, function () {});
+        } catch (e) {
+            error = e;
+        }
+        t.equal( error.message, '"colors" should be an integer between 1 and 256', 'colors: '+colors+' throws' );
     });
-    
-    t.equal( results[0].r, 255, 'results[0] red is 255' );
-    t.equal( results[0].g, 8, 'results[0] green is 8' );
-    t.equal( results[0].b, 8, 'results[0] blue is 8' );
-    t.equal( results[0].hex, 'ff0808', 'results[0] hex is ff0808' );
-    
-    t.equal( results[1].r, 223, 'results[1] red is 223' );
-    t.equal( results[1].g, 0, 'results[1] green is 0' );
-    t.equal( results[1].b, 234, 'results[1] blue is 234' );
-    t.equal( results[1].hex, 'df00ea', 'results[1] hex is df00ea' );
-    
-    t.equal( results[2].r, 28, 'results[2] red is 28' );
-    t.equal( results[2].g, 27, 'results[2] green is 27' );
-    t.equal( results[2].b, 255, 'results[2] blue is 255' );
-    t.equal( results[2].hex, '1c1bff', 'results[2] hex is 1c1bff' );
-    
-    t.equal( results[3].r, 0, 'results[3] red is 0' );
-    t.equal( results[3].g, 231, 'results[3] green is 231' );
-    t.equal( results[3].b, 226, 'results[3] blue is 226' );
-    t.equal( results[3].hex, '00e7e2', 'results[3] hex is 00e7e2' );
-    
-    t.equal( results[4].r, 25, 'results[4] red is 25' );
-    t.equal( results[4].g, 255, 'results[4] green is 255' );
-    t.equal( results[4].b, 30, 'results[4] blue is 30' );
-    t.equal( results[4].hex, '19ff1e', 'results[4] hex is 19ff1e' );
-    
     t.end();
 });
+
+test( 'convert coalesces identical jobs', function (t) {
+    var srcData = require('fs').readFileSync( "./test/test.jpg" )
+    ,   buffers = []
+    ,   pending = 3;
+    // the coalesce: false job runs in parallel and may finish first, so results go by call index
+    function done (index) {
+        return function (err, buffer) {
+            t.equal( err, undefined, 'no error' );
+            buffers[ index ] = buffer;
+            if (--pending)
+                return;
+            t.equal( buffers[0], buffers[1], 'identical jobs share one Buffer' );
+            t.notEqual( buffers[0], buffers[2], 'coalesce: false runs its own job' );
+            t.equal( buffers[0].length, buffers[2].length, 'same output' );
+            t.end();
+        };
+    }
+    imagemagick.convert({ srcData: srcData, width: 50, height: 50, format: 'jpeg' }, done(0));
+    imagemagick.convert({ srcData: srcData, width: 50, height: 50, format: 'JPEG' }, done(1));
+    imagemagick.convert({ srcData: srcData, width: 50, height: 50, format: 'JPEG', coalesce: false }, done(2));
+});
+
+test( 'setLimits maxMemory runs jobs one at a time in order', function (t) {
+    // every job is larger than 1 byte, so each runs alone and the others wait for its release
+    imagemagick.setLimits({ maxMemory: 1 });
+    var sources = [ "./test/test.jpg", "./test/test.png", "./test/test.wide.png", "./test/test.png" ]
+    ,   completed = [];
+    sources.forEach(function (path, index) {
+        imagemagick.convert({
+            srcData: require('fs').readFileSync( path ),
+            width: 10,
+            height: 10,
+            format: 'PNG',
+            coalesce: false,
+            debug: debug
+        }, function (err, buffer) {
+            t.equal( err, undefined, 'no error' );
+            t.ok( imagemagick.memoryUsage().pixels > 0, 'own reservation is held during the callback' );
+            completed.push( index );
+            if (completed.length < sources.length)
+                return;
+            t.deepEqual( completed, [ 0, 1, 2, 3 ], 'jobs complete in the order they were queued' );
+            imagemagick.setLimits({ maxMemory: 0 });
+            // the last reservation is released once this callback returns
+            setImmediate(function () {
+                t.equal( imagemagick.memoryUsage().pixels, 0, 'all reservations released' );
+                t.end();
+            });
+        });
+    });
+});
+
+test( 'setLimits keeps limits left undefined', function (t) {
+    imagemagick.setLimits({ maxPixels: 100 });
+    imagemagick.setLimits({ maxMemory: 1024 * 1024 * 1024 });
+    imagemagick.convert({
+        srcData: require('fs').readFileSync( "./test/test.png" ), // 58x66
+        width: 10,
+        debug: debug
+    }, function (err) {
+        t.equal( err.code, 'EMAXPIXELS', 'maxPixels still applies' );
+        imagemagick.setLimits({ maxPixels: 0, maxMemory: 0 });
+        t.end();
+    });
+});
+
+test( 'setAllowedFormats rejects other inputs', function (t) {
+    var error = 0;
+    try {
+        imagemagick.setAllowedFormats([ 'NOSUCHFORMAT' ]);
+    } catch (e) {
+        error = e;
+    }
+    t.equal( error.message, 'no decoder for format: NOSUCHFORMAT' );
+
+    imagemagick.setAllowedFormats([ 'jpeg', 'PNG' ]);
+    imagemagick.convert({
+        srcData: new Buffer( 'BM not a real bitmap' ),
+        width: 10,
+        debug: debug
+    }, function (err, buffer) {
+        t.equal( err.code, 'EFORMAT', 'err code' );
+        t.equal( err.message, 'image format is not allowed', 'err message' );
+
+        imagemagick.convert({
+            srcData: require('fs').readFileSync( "./test/test.png" ),
+            inputFormat: 'gif',
+            width: 10,
+            debug: debug
+        }, function (err, buffer) {
+            t.equal( err.message, 'image format is not allowed: GIF', 'inputFormat is checked too' );
+
+            imagemagick.convert({
+                srcData: require('fs').readFileSync( "./test/test.png" ),
+                width: 10,
+                format: 'PNG',
+                debug: debug
+            }, function (err, buffer) {
+                t.equal( err, undefined, 'sniffed PNG is allowed' );
+                t.equal( Buffer.isBuffer(buffer), true, 'buffer is Buffer' );
+                imagemagick.setAllowedFormats([]);
+                t.end();
+            });
+        });
+    });
+});
+
+test( 'setAllowedFormats rejects without waiting for decodes', function (t) {
+    imagemagick.setAllowedFormats([ 'JPEG' ]);
+    var order = [], returned = false;
+    imagemagick.convert({
+        srcData: require('fs').readFileSync( "./test/test.jpg" ),
+        width: 100,
+        format: 'PNG',
+        coalesce: false,
+        debug: debug
+    }, function (err) {
+        t.equal( err, undefined, 'no error' );
+        order.push( 'decode' );
+        t.deepEqual( order, [ 'reject', 'decode' ], 'the rejection came first' );
+        imagemagick.setAllowedFormats([]);
+        t.end();
+    });
+    imagemagick.convert({
+        srcData: require('fs').readFileSync( "./test/test.png" ),
+        width: 100,
+        debug: debug
+    }, function (err) {
+        t.equal( err.code, 'EFORMAT', 'err code' );
+        t.ok( returned, 'callback runs after convert() returned' );
+        order.push( 'reject' );
+    });
+    returned = true;
+});
+
+// 2x2 uncompressed true color TGA, a format without magic bytes
+function tga() {
+    var header = new Buffer( 18 );
+    header.fill( 0 );
+    header[ 2 ]  = 2;  // uncompressed true color
+    header[ 12 ] = 2;  // width
+    header[ 14 ] = 2;  // height
+    header[ 16 ] = 24; // bits per pixel
+    var pixels = new Buffer( 2 * 2 * 3 );
+    pixels.fill( 0x80 );
+    return Buffer.concat([ header, pixels ]);
+}
+
+test( 'inputFormat selects the decoder', function (t) {
+    imagemagick.convert({
+        srcData: require('fs').readFileSync( "./test/test.png" ),
+        inputFormat: 'JPEG',
+        width: 10,
+        debug: debug
+    }, function (err, buffer) {
+        t.ok( err instanceof Error, 'PNG bytes fail as JPEG' );
+        t.equal( buffer, undefined, 'buffer undefined' );
+
+        imagemagick.convert({
+            srcData: tga(),
+            format: 'PNG',
+            debug: debug
+        }, function (err, buffer) {
+            t.ok( err instanceof Error, 'TGA is not detected without a hint' );
+
+            imagemagick.convert({
+                srcData: tga(),
+                inputFormat: 'tga',
+                width: 4,
+                height: 4,
+                resizeStyle: 'fill',
+                format: 'PNG',
+                debug: debug
+            }, function (err, buffer) {
+                t.equal( err, undefined, 'TGA decodes with the hint' );
+                t.equal( Buffer.isBuffer(buffer), true, 'buffer is Buffer' );
+                t.end();
+            });
+        });
+    });
+});
+
+function runPoolChild (mode, callback) {
+    require('child_process').fork( __dirname + '/pool_child.js', [ mode ] ).on( 'message', callback );
+}
+
+test( 'worker pool survives a crashing helper', function (t) {
+    runPoolChild( 'crash', function (results) {
+        t.equal( results[0].error, 'helper process crashed with signal 11', 'the crash fails its own job' );
+        t.equal( results[1].error, null, 'the next job runs in the respawned helper' );
+        t.ok( results[1].length > 0, 'and produces output' );
+        t.end();
+    });
+});
+
+test( 'worker pool kills a hanging helper', function (t) {
+    runPoolChild( 'hang', function (results) {
+        t.equal( results[0].error, 'helper process timed out after 500 ms', 'the hung job times out' );
+        t.equal( results[1].error, null, 'the next job runs in the respawned helper' );
+        t.ok( results[1].length > 0, 'and produces output' );
+        t.end();
+    });
+});
+
+// starts the pool for the rest of the process, keep this last
+test( 'convert in worker pool', function (t) {
+    imagemagick.setWorkerPool({ size: 1 });
+    var error = 0;
+    try {
+        imagemagick.setWorkerPool({ size: 1 });
+    } catch (e) {
+        error = e;
+    }
+    t.similar( error.message, /already started/, 'pool starts once' );
+
+    imagemagick.convert({
+        srcData: require('fs').readFileSync( "./test/test.png" ), // 58x66
+        width: 100,
+        height: 100,
+        resizeStyle: 'aspectfit',
+        format: 'PNG',
+        analyze: true,
+        debug: debug
+    }, function (err, buffer, analysis) {
+        t.equal( err, undefined, 'no error' );
+        t.equal( Buffer.isBuffer(buffer), true, 'buffer is Buffer' );
+        t.equal( analysis.phash.length, 16, 'phash is 16 hex chars' );
+        saveToFileIfDebug( buffer, "./test/out.pool.png" );
+
+        // a valid header with the image data cut off, only a full read notices
+        var png = require('fs').readFileSync( "./test/test.png" );
+        imagemagick.convert({
+            srcData: png.slice( 0, 64 ),
+            width: 10,
+            debug: debug
+        }, function (err) {
+            t.similar( err.message, /image\.read failed in helper with error/, 'decode errors come back from the helper' );
+
+            imagemagick.convert({
+                srcData: png,
+                width: 10,
+                maxPixels: 100,
+                debug: debug
+            }, function (err) {
+                t.equal( err.code, 'EMAXPIXELS', 'the helper pings and checks maxPixels' );
+                t.equal( err.message, 'image exceeds maxPixels: 58x66', 'err message' );
+                t.end();
+            });
+        });
+    });
+});